@@ -4,11 +4,21 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <cstring>
+#include <functional>
 #include <span>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
+#include "smallz4_metrics.hpp"
+#include "smallz4_probes.hpp"
+#include "smallz4_trace.hpp"
+
 // Compression levels:
 // 0: No compression
 // 1 - 3: Greedy search, check 1 to 3 matches
@@ -26,6 +36,361 @@ struct smallz4
       obj.compress(it, end, b, ix, dictionary);
    }
 
+   /// create a reusable compressor, its match finder tables stay allocated between calls to compress()
+   /** keep one per worker thread when compressing many inputs, saves the 8 MB lastHash allocation per input **/
+   explicit smallz4(uint16_t newMaxChainLength = MaxChainLength) : maxChainLength(newMaxChainLength) {}
+
+   /// switch compression level of a reusable compressor (keeps its tables allocated)
+   void setMaxChainLength(uint16_t newMaxChainLength) { maxChainLength = newMaxChainLength; }
+
+   // optional streaming hooks of compress(), e.g. for asynchronous I/O (both may be left empty)
+   /// called before a block is processed: the first numBytes of the input must be readable afterwards
+   std::function<void(size_t numBytes)> waitForInput{};
+   /// called after each block: may hand b[0, ix) over to someone else and then set ix = 0
+   std::function<void(std::string& b, size_t& ix)> flushOutput{};
+
+   /// thrown by compress() if it was cancelled
+   struct Cancelled : std::runtime_error
+   {
+      Cancelled() : std::runtime_error("cancelled") {}
+   };
+   // optional cooperative cancellation and progress reports, both are checked before each block and every
+   // CheckpointInterval positions within a block (that's a few milliseconds even at level 9)
+   /// set to true by another thread to abandon compress() (throws Cancelled, b holds an incomplete frame)
+   const std::atomic<bool>* cancelled = nullptr;
+   /// called with the number of input bytes processed so far and the total input size
+   std::function<void(uint64_t done, uint64_t total)> progress{};
+
+   /// forget all history every restartInterval blocks (0 = never), blocks in between stay linked
+   /** the offsets of these restart points are appended as a skippable frame (see readRestartIndex), a decoder can
+       then process each group of blocks on its own thread **/
+   uint32_t restartInterval = 0;
+
+   // restart index = skippable frame after the LZ4 frame:
+   // magic (4 bytes), payload size (4 bytes), payload:
+   // - per restart point: compressed offset (relative to the frame's first byte) and decompressed offset, 8 bytes each
+   // - decompressed size (8 bytes), number of restart points (4 bytes), RestartIndexFooter (4 bytes)
+   // the footer is at the very end, so that the index can be found without parsing the LZ4 frame
+   static constexpr uint32_t RestartIndexMagic = 0x184D2A5E;
+   static constexpr uint32_t RestartIndexFooter = 0x52345A53; // "SZ4R"
+
+   /// where a group of blocks without references to earlier blocks begins
+   struct RestartPoint
+   {
+      uint64_t compressedOffset; // first byte of the block header, relative to the beginning of the LZ4 frame
+      uint64_t decompressedOffset;
+   };
+
+   /// look for a restart index at the end of [begin, end), return false if there is none
+   static bool readRestartIndex(const unsigned char* begin, const unsigned char* end, std::vector<RestartPoint>& points,
+                                uint64_t& decompressedSize)
+   {
+      constexpr size_t TrailerSize = 8 + 4 + 4;
+      if (size_t(end - begin) < 8 + TrailerSize) return false;
+
+      uint32_t footer, numPoints;
+      std::memcpy(&footer, end - 4, 4);
+      std::memcpy(&numPoints, end - 8, 4);
+      std::memcpy(&decompressedSize, end - 16, 8);
+      if (footer != RestartIndexFooter) return false;
+
+      const size_t payloadSize = size_t(numPoints) * 16 + TrailerSize;
+      if (size_t(end - begin) < 8 + payloadSize) return false;
+      const unsigned char* frame = end - payloadSize - 8;
+      uint32_t magic, size;
+      std::memcpy(&magic, frame, 4);
+      std::memcpy(&size, frame + 4, 4);
+      if (magic != RestartIndexMagic || size != payloadSize) return false;
+
+      points.resize(numPoints);
+      for (uint32_t i = 0; i < numPoints; ++i) {
+         std::memcpy(&points[i].compressedOffset, frame + 8 + i * 16, 8);
+         std::memcpy(&points[i].decompressedOffset, frame + 8 + i * 16 + 8, 8);
+      }
+      return true;
+   }
+
+   /// greedy and lazy levels (1 - 6): skip more and more positions after 2^missAcceleration misses in a row
+   /** like liblz4's acceleration: stretches without any match (e.g. embedded compressed data) are scanned with
+       increasing strides until the next match is found, 0 = check every position (default)
+     - opt-in because it changes the output of levels 1 - 6 (e.g. 6 = skip after 64 misses) **/
+   uint8_t missAcceleration = 0;
+
+   /// wild-copy-friendly output (still standard LZ4), so that a decoder rarely needs its slow paths (0 = off)
+   /** - matches closer than wildCopyDistance (e.g. 16) overlap with their own output when copied in 16 byte chunks:
+         they are moved to a farther distance with the same bytes (a multiple of the original distance) or replaced by
+         literals, unless that costs more than wildCopyPenalty bytes
+       - no match ends within the last wildCopyTail bytes (e.g. 32) of a block, so literals can be copied in chunks
+         there, too **/
+   uint16_t wildCopyDistance = 0;
+   uint16_t wildCopyPenalty = 8;
+   uint16_t wildCopyTail = 0;
+
+   /// content-defined chunking: block boundaries depend on the data instead of fixed 4 MB steps (0 = disabled)
+   /** - a gear hash rolls over the input and a block ends where its highest bits are zero (FastCDC's normalized
+         chunking), but never before chunkMinSize or after chunkMaxSize bytes
+       - each chunk is an independent block (like a restart point), so identical chunks always produce identical
+         compressed bytes even if data was inserted or removed in front of them
+       - chunkAverageSize must be a power of two and chunkMaxSize at most 4 MB **/
+   uint32_t chunkAverageSize = 0;
+   uint32_t chunkMinSize = 0;
+   uint32_t chunkMaxSize = 0;
+
+   /// end blocks only right after this byte (e.g. '\n' for JSON lines), -1 = anywhere
+   /** - a block is cut after the last delimiter before its regular end, so no record straddles two blocks unless a
+         single record is longer than a whole block
+       - add restartInterval = 1 so that a downstream job can decode each block on its own **/
+   int recordDelimiter = -1;
+
+   /// match finder state right after hashing a dictionary (see smallz4_dictionary.hpp for a shareable file format)
+   /** all positions refer to content, which starts at position 0 **/
+   struct DictionaryTables
+   {
+      std::span<const unsigned char> content; // at most the dictionary's last 65535 bytes
+      const uint32_t* lastHash; // DictionaryHashSize entries, most recent position or NoDictionaryHash
+      const uint16_t* previousHash; // 65536 entries
+      const uint16_t* previousExact; // 65536 entries
+   };
+   static constexpr size_t DictionaryHashSize = size_t(1) << 20; // = HashSize
+   static constexpr size_t DictionaryChainSize = 65536; // = MaxDistance + 1
+   static constexpr uint32_t NoDictionaryHash = ~0u;
+
+   /// look up the dictionary's positions in these tables instead of hashing a dictionary (nullptr = none)
+   /** only used if compress() receives no dictionary, the tables are read in place (not copied) and must stay valid
+       while compressing **/
+   const DictionaryTables* sharedDictionary = nullptr;
+
+   /// hash a dictionary's positions, write DictionaryHashSize / DictionaryChainSize entries to the output tables
+   /** content must not exceed 65535 bytes, the last 3 positions are left out (they need the input's first bytes) **/
+   static void buildDictionaryTables(std::span<const unsigned char> content, uint32_t* outLastHash,
+                                     uint16_t* outPreviousHash, uint16_t* outPreviousExact)
+   {
+      if (content.size() > MaxDistance) throw std::runtime_error("dictionary too large");
+
+      smallz4 builder;
+      builder.lastHash.assign(HashSize, NoLastHash);
+      builder.previousHash.assign(MaxDistance + 1, Distance(EndOfChain));
+      builder.previousExact.assign(MaxDistance + 1, Distance(EndOfChain));
+      for (size_t pos = 0; pos + 4 <= content.size(); ++pos) {
+         uint32_t four;
+         std::memcpy(&four, content.data() + pos, 4);
+         builder.insertPosition(four, pos, content.data(), 0, 0);
+      }
+
+      for (size_t hash = 0; hash < HashSize; ++hash) {
+         const uint64_t pos = builder.lastHash[hash];
+         outLastHash[hash] = (pos == NoLastHash) ? NoDictionaryHash : uint32_t(pos);
+      }
+      std::memcpy(outPreviousHash, builder.previousHash.data(), DictionaryChainSize * sizeof(uint16_t));
+      std::memcpy(outPreviousExact, builder.previousExact.data(), DictionaryChainSize * sizeof(uint16_t));
+   }
+
+   /// limit the extra room a block needs when decoded in place (0 = unlimited), see unlz4InPlace() in smallz4.cpp
+   /** - in-place decoding writes the output in front of the compressed bytes, which sit at the end of the same buffer
+       - a block whose writes would overtake its reads by more than inPlaceBlockMargin bytes is stored uncompressed
+       - then a frame needs at most decompressed size + inPlaceBlockMargin + 4 * (number of blocks + 1) bytes
+         (plus a restart index, if any) **/
+   uint32_t inPlaceBlockMargin = 0;
+
+   /// split the output into several self-contained frames of at most maxFrameSize bytes each (0 = single frame)
+   /** - e.g. for message queues with a size limit, each frame can be decoded on its own
+       - a block never needs more than its decompressed size plus its 4 byte header (it's stored uncompressed if
+         compression doesn't help), so blocks are cut such that even their worst case fits into the current frame
+       - once less than 1/32 of maxFrameSize is left, a new frame begins (and forgets all history)
+       - thus each byte is compressed only once, no trial-and-error
+       - can't be combined with restartInterval **/
+   uint32_t maxFrameSize = 0;
+   /// smallest supported maxFrameSize
+   static constexpr uint32_t MinFrameSize = 1024;
+
+   /// a range of the input whose bytes are known to be zero (offsets relative to the input's first byte)
+   struct ZeroRange
+   {
+      uint64_t begin;
+      uint64_t end;
+   };
+   /// optional: first range of zeros at or after offset (e.g. a hole of a sparse file), empty range if there is none
+   /** blocks are cut at such ranges and a range becomes a block which is encoded without scanning its bytes
+       (ranges shorter than MinZeroRun are ignored) **/
+   std::function<ZeroRange(uint64_t offset)> knownZeros{};
+   static constexpr uint64_t MinZeroRun = 4096;
+
+   /// position of a frame within compress()'s output (relative to its first frame)
+   struct Frame
+   {
+      uint64_t compressedOffset;
+      uint64_t compressedSize;
+      uint64_t decompressedOffset;
+      uint64_t decompressedSize;
+   };
+   /// optional: called after each frame was completed (including its end marker)
+   std::function<void(const Frame& frame)> frameDone{};
+
+   /// position and content hash of a block
+   struct Chunk
+   {
+      uint64_t decompressedOffset;
+      uint32_t decompressedSize;
+      uint64_t compressedOffset; // block header's first byte, relative to the beginning of the LZ4 frame
+      uint32_t compressedSize; // including the 4 byte block header
+      uint64_t hash; // chunkHash() of the decompressed bytes
+      uint64_t firstRecord; // number of delimiters in front of this block (0 if there is no recordDelimiter)
+      uint64_t numRecords; // number of delimiters in this block (0 if there is no recordDelimiter)
+   };
+   /// optional: called after each block has been written (with or without content-defined chunking)
+   std::function<void(const Chunk& chunk)> chunkDone{};
+
+   /// append a block index (each block's size and content hash, see readBlockIndex), all blocks become independent
+   /** - a later version of the same input can then be recompressed incrementally: unchanged blocks are copied
+         verbatim from the previous version's output (see previousBlock), only modified blocks are compressed
+       - combine with content-defined chunking, else a single inserted byte shifts all following fixed-size blocks
+       - can't be combined with maxFrameSize **/
+   bool storeBlockIndex = false;
+
+   // block index = skippable frame after the LZ4 frame (in front of the restart index, if there is one):
+   // magic (4 bytes), payload size (4 bytes), payload:
+   // - per block: compressed offset (relative to the frame's first byte, 8 bytes), compressed size (including its
+   //   block header, 4 bytes), decompressed size (4 bytes) and chunkHash() of its decompressed bytes (8 bytes)
+   // - settingsHash() of the compressor (8 bytes), number of blocks (4 bytes), BlockIndexFooter (4 bytes)
+   static constexpr uint32_t BlockIndexMagic = 0x184D2A5F;
+   static constexpr uint32_t BlockIndexFooter = 0x42345A53; // "SZ4B"
+
+   /// an independent block listed in a block index
+   struct IndexedBlock
+   {
+      uint64_t compressedOffset; // first byte of the block header, relative to the beginning of the LZ4 frame
+      uint32_t compressedSize; // including the 4 byte block header
+      uint32_t decompressedSize;
+      uint64_t hash; // chunkHash() of the decompressed bytes
+   };
+
+   /// look for a block index at the end of [begin, end) (possibly followed by a restart index), false if none
+   /** settings receives the settingsHash() of the compressor which produced the blocks **/
+   static bool readBlockIndex(const unsigned char* begin, const unsigned char* end, std::vector<IndexedBlock>& blocks,
+                              uint64_t& settings)
+   {
+      // skip restart index
+      std::vector<RestartPoint> points;
+      uint64_t decompressedSize;
+      if (readRestartIndex(begin, end, points, decompressedSize)) {
+         end -= 8 + points.size() * 16 + 8 + 4 + 4;
+      }
+
+      constexpr size_t TrailerSize = 8 + 4 + 4;
+      if (size_t(end - begin) < 8 + TrailerSize) return false;
+
+      uint32_t footer, numBlocks;
+      std::memcpy(&footer, end - 4, 4);
+      std::memcpy(&numBlocks, end - 8, 4);
+      if (footer != BlockIndexFooter) return false;
+
+      const size_t payloadSize = size_t(numBlocks) * 24 + TrailerSize;
+      if (size_t(end - begin) < 8 + payloadSize) return false;
+      const unsigned char* frame = end - payloadSize - 8;
+      uint32_t magic, size;
+      std::memcpy(&magic, frame, 4);
+      std::memcpy(&size, frame + 4, 4);
+      if (magic != BlockIndexMagic || size != payloadSize) return false;
+
+      std::memcpy(&settings, end - TrailerSize, 8);
+      blocks.resize(numBlocks);
+      for (uint32_t i = 0; i < numBlocks; ++i) {
+         const unsigned char* entry = frame + 8 + i * 24;
+         std::memcpy(&blocks[i].compressedOffset, entry, 8);
+         std::memcpy(&blocks[i].compressedSize, entry + 8, 4);
+         std::memcpy(&blocks[i].decompressedSize, entry + 12, 4);
+         std::memcpy(&blocks[i].hash, entry + 16, 8);
+      }
+      return true;
+   }
+
+   /// optional: an earlier version's compressed block (including its block header) with that content, else empty
+   /** - only asked if storeBlockIndex is set and there is no dictionary, e.g. look up the hash in the block index
+         of the previous output
+       - the previous output must have the same block boundaries (same chunking settings) to find anything
+       - and it should have been produced with the same settingsHash(), else the output depends on history
+       - a compressed block is still stored uncompressed if it exceeds inPlaceBlockMargin **/
+   std::function<std::span<const unsigned char>(uint64_t hash, uint32_t decompressedSize)> previousBlock{};
+
+   /// fingerprint of all settings which affect how a block is encoded (stored in the block index)
+   uint64_t settingsHash() const
+   {
+      unsigned char settings[16] = {};
+      std::memcpy(settings, &maxChainLength, 2);
+      std::memcpy(settings + 2, &wildCopyDistance, 2);
+      std::memcpy(settings + 4, &wildCopyPenalty, 2);
+      std::memcpy(settings + 6, &wildCopyTail, 2);
+      std::memcpy(settings + 8, &inPlaceBlockMargin, 4);
+      settings[12] = missAcceleration;
+      return chunkHash(settings, sizeof(settings));
+   }
+
+   /// fast 64 bit hash of a chunk's decompressed bytes (not cryptographic)
+   static uint64_t chunkHash(const unsigned char* data, size_t size)
+   {
+      constexpr uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+      constexpr uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+      uint64_t hash = size * Prime1;
+      size_t pos = 0;
+      for (; pos + 8 <= size; pos += 8) {
+         uint64_t eight;
+         std::memcpy(&eight, data + pos, 8);
+         hash ^= eight * Prime2;
+         hash = ((hash << 31) | (hash >> 33)) * Prime1;
+      }
+      for (; pos < size; ++pos) {
+         hash ^= data[pos] * Prime1;
+         hash = ((hash << 23) | (hash >> 41)) * Prime2;
+      }
+      // final avalanche
+      hash ^= hash >> 33;
+      hash *= Prime2;
+      hash ^= hash >> 29;
+      return hash;
+   }
+
+   /// length of the first content-defined chunk of data[0, size), see chunkAverageSize
+   static size_t findChunkEnd(const unsigned char* data, size_t size, uint32_t minSize, uint32_t averageSize,
+                              uint32_t maxSize)
+   {
+      if (size <= minSize) return size;
+      if (size > maxSize) size = maxSize;
+
+      // gear table: 256 pseudo-random 64 bit values (SplitMix64)
+      static constexpr auto Gear = [] {
+         std::array<uint64_t, 256> result{};
+         uint64_t state = 0;
+         for (auto& value : result) {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            value = z ^ (z >> 31);
+         }
+         return result;
+      }();
+
+      // normalized chunking: harder to cut before the average size, easier afterwards
+      // (only the highest bits are checked because they depend on the most recent 64 bytes)
+      int bits = 0;
+      while ((uint32_t(1) << (bits + 1)) <= averageSize) ++bits;
+      const uint64_t maskHard = ~uint64_t(0) << (64 - (bits + 1));
+      const uint64_t maskEasy = ~uint64_t(0) << (64 - (bits - 1));
+
+      // the hash is a single shift-and-add per byte, keep that dependency chain free of anything else
+      const size_t normal = (std::min)(size, size_t(averageSize));
+      uint64_t hash = 0;
+      size_t pos = minSize;
+      for (; pos < normal; ++pos) {
+         hash = (hash << 1) + Gear[data[pos]];
+         if ((hash & maskHard) == 0) return pos + 1;
+      }
+      for (; pos < size; ++pos) {
+         hash = (hash << 1) + Gear[data[pos]];
+         if ((hash & maskEasy) == 0) return pos + 1;
+      }
+      return size;
+   }
+
    // compression level thresholds
    /// greedy mode for short chains (compression level <= 3) instead of optimal parsing / lazy evaluation
    static constexpr int ShortChainsGreedy = 3;
@@ -115,20 +480,51 @@ struct smallz4
    // number of literals and match length is encoded in several bytes, max 255 per byte
    static constexpr int MaxLengthCode = 255;
 
-   //  ----- one and only variable ... -----
+   /// marker for "hash not seen yet" in lastHash
+   static constexpr uint64_t NoLastHash = ~0; // = -1
+
+   /// look at cancelled and report progress after that many positions of the match finder
+   static constexpr int64_t CheckpointInterval = 4 * 1024;
 
    /// how many matches are checked in findLongestMatch, lower values yield faster encoding at the cost of worse
    /// compression ratio
    uint16_t maxChainLength{};
-   
+
    struct Matches
    {
       std::vector<Length> lengths{}; // lengths of matches
       std::vector<Distance> distances{}; // distances of matches
+      std::vector<Length> choices{}; // match lengths chosen by estimateCosts
+      std::vector<uint32_t> costs{}; // estimateCosts' scratch space
    };
 
-   /// create new compressor (only invoked by lz4)
-   explicit smallz4(uint16_t newMaxChainLength = MaxChainLength) : maxChainLength(newMaxChainLength) {}
+   /// match finding and parsing alternate every TileSize positions (see compress), keeps their data in L2 cache
+   static constexpr uint64_t TileSize = 16 * 1024;
+   /// optimal parsing looks that far beyond the positions it commits to
+   /** the cheapest path rarely changes much more than a few dozen bytes ahead, this is plenty **/
+   static constexpr uint64_t TileLookahead = 4 * 1024;
+
+   //  ----- match finder state, kept between calls so that a compressor can be reused -----
+
+   /// last time we saw a hash
+   std::vector<uint64_t> lastHash{};
+   /// previous position which starts with the same bytes (long chains based on my simple hash)
+   std::vector<Distance> previousHash{};
+   /// shorter chains based on exact matching of the first four bytes
+   std::vector<Distance> previousExact{};
+   /// sharedDictionary's tables are looked up directly for positions in front of sharedEnd (instead of copying them)
+   const uint32_t* sharedLastHash = nullptr;
+   const Distance* sharedPreviousHash = nullptr;
+   const Distance* sharedPreviousExact = nullptr;
+   uint64_t sharedEnd = 0;
+   /// per-position matches of the current block
+   Matches matches{};
+   /// compressed bytes of the current block
+   std::vector<unsigned char> compressed{};
+   /// dictionary followed by the first 64k + 4 MB of input (matches may cross from the input into the dictionary)
+   std::vector<unsigned char> window{};
+   /// chain steps of the current block's findLongestMatch calls (only if metrics are compiled in)
+   SMALLZ4_METRICS_ONLY(mutable smallz4_metrics::StepHistogram stepHistogram{}; mutable uint64_t stepSum = 0;)
 
    /// return true, if the four bytes at *a and *b match
    inline static constexpr bool match4(const void* const a, const void* const b) noexcept
@@ -144,7 +540,96 @@ struct smallz4
       return ((fourBytes * HashMultiplier) >> (32 - HashBits)) & (HashSize - 1);
    }
 
+   /// add position pos (its first four bytes are "four") to the hash chains
+   /** - data[0] corresponds to position dataZero, no chain reaches in front of segmentBegin
+       - returns false if no recent position starts with the same four bytes (=> no match possible) **/
+   bool insertPosition(const uint32_t four, const uint64_t pos, const unsigned char* const data,
+                       const uint64_t dataZero, const uint64_t segmentBegin)
+   {
+      const uint32_t hash = getHash32(four); // convert to a shorter hash
+
+      uint64_t lastHashMatch = lastHash[hash]; // get most recent position of this hash
+      lastHash[hash] = pos; // and store current position
+      // not seen in the input yet, but maybe in a shared dictionary
+      if (lastHashMatch == NoLastHash && sharedLastHash != nullptr && sharedLastHash[hash] != NoDictionaryHash) {
+         lastHashMatch = sharedLastHash[hash];
+      }
+
+      // chains are indexed by absolute position because blocks don't always start at a multiple of 64k
+      const Distance prevIndex = Distance(pos & MaxDistance);
+
+      // no predecessor / no hash chain available (or located before the most recent restart point) ?
+      if (lastHashMatch == NoLastHash || lastHashMatch < segmentBegin) {
+         previousHash[prevIndex] = EndOfChain;
+         previousExact[prevIndex] = EndOfChain;
+         return false;
+      }
+
+      // most recent hash match too far away ?
+      uint64_t distance = pos - lastHashMatch;
+      if (distance > MaxDistance) {
+         previousHash[prevIndex] = EndOfChain;
+         previousExact[prevIndex] = EndOfChain;
+         return false;
+      }
+
+      // build hash chain, i.e. store distance to last pseudo-match
+      previousHash[prevIndex] = Distance(distance);
+
+      // skip pseudo-matches (hash collisions) and build a second chain where the first four bytes must match
+      // exactly
+      uint32_t currentFour;
+      // check the hash chain
+      while (true) {
+         // read four bytes
+         // match may be found in the previous block, too
+         std::memcpy(&currentFour, data + (lastHashMatch - dataZero), 4);
+         // match chain found, first 4 bytes are identical
+         if (currentFour == four) {
+            break;
+         }
+
+         // prevent from accidently hopping on an old, wrong hash chain
+         if (hash != getHash32(currentFour)) {
+            break;
+         }
+
+         // try next pseudo-match
+         const Distance next =
+            lastHashMatch < sharedEnd ? sharedPreviousHash[lastHashMatch] : previousHash[lastHashMatch & MaxDistance];
+         // end of the hash chain ?
+         if (next == EndOfChain) {
+            break;
+         }
+
+         // too far away ?
+         distance += next;
+         if (distance > MaxDistance) {
+            break;
+         }
+
+         // take another step along the hash chain ...
+         lastHashMatch -= next;
+         // closest match is out of range ?
+         if (lastHashMatch < dataZero) {
+            break;
+         }
+      }
+
+      // search aborted / failed ?
+      if (four != currentFour) {
+         // no matches for the first four bytes
+         previousExact[prevIndex] = EndOfChain;
+         return false;
+      }
+
+      // store distance to previous match
+      previousExact[prevIndex] = (Distance)distance;
+      return true;
+   }
+
    /// find longest match of data[pos] between data[begin] and data[end], use match chain
+   /** chain is previousExact (positions in front of sharedEnd are found in sharedPreviousExact) **/
    void findLongestMatch(const unsigned char* const data, uint64_t pos, uint64_t begin, uint64_t end,
                           const Distance* const chain, Length& result_length, Distance& result_distance) const
    {
@@ -162,14 +647,18 @@ struct smallz4
       // get distance to previous match, abort if 0 => not existing
       Distance distance = chain[pos & MaxDistance];
       uint32_t totalDistance = 0;
+      SMALLZ4_METRICS_ONLY(uint32_t numSteps = 0;)
       while (distance != EndOfChain) {
+         SMALLZ4_METRICS_ONLY(++numSteps;)
          // chain goes too far back ?
          totalDistance += distance;
          if (totalDistance > MaxDistance) {
             break; // can't match beyond 64k
          }
          
-         distance = chain[(pos - totalDistance) & MaxDistance]; // prepare next position
+         // prepare next position
+         const uint64_t previous = pos - totalDistance;
+         distance = previous < sharedEnd ? sharedPreviousExact[previous] : chain[previous & MaxDistance];
 
          // let's introduce a new pointer atLeast that points to the first "new" byte of a potential longer match
          const unsigned char* const atLeast = current + result_length + 1;
@@ -228,28 +717,69 @@ struct smallz4
             break;
          }
       }
+      SMALLZ4_METRICS_ONLY(++stepHistogram[smallz4_metrics::stepBucket(numSteps)]; stepSum += numSteps;)
+   }
+
+   /// LZ4 sequences of a block with numZeros zeros (at least MinZeroRun)
+   /** a few literal zeros (numLeading), repeated by a match with distance numLeading, followed by numTrailing final
+       literals (at least BlockEndLiterals), numZeros must exceed numLeading + MinMatch + numTrailing **/
+   static void encodeZeros(uint64_t numZeros, uint64_t numLeading, uint64_t numTrailing,
+                           std::vector<unsigned char>& result)
+   {
+      // length code beyond the token's nibble
+      auto addLength = [&result](uint64_t lengthCode) {
+         for (lengthCode -= 15; lengthCode >= MaxLengthCode; lengthCode -= MaxLengthCode) {
+            result.push_back(MaxLengthCode);
+         }
+         result.push_back((unsigned char)lengthCode);
+      };
+
+      result.clear();
+      const uint64_t matchLength = numZeros - numLeading - numTrailing;
+      uint64_t lengthCode = matchLength - MinMatch;
+      result.push_back((unsigned char)(((numLeading < 15 ? numLeading : 15) << 4) | (lengthCode < 15 ? lengthCode : 15)));
+      if (numLeading >= 15) addLength(numLeading);
+      result.insert(result.end(), numLeading, 0); // literals
+      result.push_back((unsigned char)(numLeading & 0xFF)); // distance (little endian)
+      result.push_back((unsigned char)(numLeading >> 8));
+      if (lengthCode >= 15) addLength(lengthCode);
+
+      result.push_back((unsigned char)((numTrailing < 15 ? numTrailing : 15) << 4));
+      if (numTrailing >= 15) addLength(numTrailing);
+      result.insert(result.end(), numTrailing, 0);
    }
 
-   /// create shortest output
-   /** data points to block's begin; we need it to extract literals **/
-   static void selectBestMatches(const Matches& matches,
-                                                       const unsigned char* const data, std::vector<unsigned char>& result)
+   /// state of selectBestMatches() between two tiles
+   struct Sequences
    {
-      const auto n_matches = matches.lengths.size();
-      result.resize(n_matches);
-      size_t ix{}; // write index for result
+      uint64_t offset = 0; // next position, relative to the block's first byte
+      uint64_t literalsFrom = 0; // current run of literals
+      uint64_t numLiterals = 0;
+      size_t ix = 0; // write index for result
+   };
+
+   /// create shortest output for all positions in front of stop (a match may end beyond it)
+   /** data points to block's begin; we need it to extract literals
+       lengths and distances are the chosen matches, their first element belongs to position firstPosition
+       the last token is written when stop reaches blockSize **/
+   static void selectBestMatches(const Length* const lengths, const Distance* const distances, uint64_t firstPosition,
+                                 const unsigned char* const data, uint64_t stop, uint64_t blockSize,
+                                 Sequences& sequences, std::vector<unsigned char>& result)
+   {
+      size_t ix = sequences.ix; // write index for result
 
       // indices of current run of literals
-      size_t literalsFrom = 0;
-      size_t numLiterals = 0;
+      size_t literalsFrom = size_t(sequences.literalsFrom);
+      size_t numLiterals = size_t(sequences.numLiterals);
 
       bool lastToken = false;
 
-      // walk through the whole block
-      for (size_t offset = 0; offset < n_matches;) // increment inside of loop
+      // walk through the block
+      uint64_t offset = sequences.offset;
+      while (offset < stop) // increment inside of loop
       {
-         const auto length = matches.lengths[offset]; // get best cost-weighted match
-         const auto distance = matches.distances[offset]; // get best cost-weighted match
+         const auto length = lengths[offset - firstPosition]; // get best cost-weighted match
+         const auto distance = distances[offset - firstPosition]; // get best cost-weighted match
 
          // if no match, then count literals instead
          if (length <= JustLiteral) {
@@ -262,7 +792,7 @@ struct smallz4
             ++offset; // next match
 
             // continue unless it's the last literal
-            if (offset < n_matches) {
+            if (offset < blockSize) {
                continue;
             }
 
@@ -330,33 +860,42 @@ struct smallz4
          }
       }
       
-      result.resize(ix);
+      sequences.offset = offset;
+      sequences.literalsFrom = literalsFrom;
+      sequences.numLiterals = numLiterals;
+      sequences.ix = ix;
    }
 
-   /// walk backwards through all matches and compute number of compressed bytes from current position to the end of the
-   /// block
-   /** note: matches are modified (shortened length) if necessary **/
-   static void estimateCosts(Matches& matches)
+   /// walk backwards through matches[begin, end) and compute number of compressed bytes from current position to end
+   /** note: the chosen (maybe shortened) match lengths are stored in matches.choices
+       isBlockEnd: the block ends at end, else nothing is known beyond end (its cost is assumed to be zero, so the
+       choices close to end are preliminary)
+       matches closer than shortDistance cost shortDistancePenalty extra bytes (see wildCopyDistance) **/
+   static void estimateCosts(Matches& matches, size_t begin, size_t end, bool isBlockEnd, Distance shortDistance = 0,
+                             uint32_t shortDistancePenalty = 0)
    {
-      const size_t blockEnd = matches.lengths.size();
-
       // equals the number of bytes after compression
       using Cost = uint32_t;
-      // minimum cost from this position to the end of the current block
-      std::vector<Cost> cost(blockEnd, 0);
+      // minimum cost from this position to end, cost[0] belongs to begin
+      std::vector<Cost>& cost = matches.costs;
+      cost.assign(end - begin + 1, 0);
       // "cost" represents the number of bytes needed
+      matches.choices.resize(matches.lengths.size());
 
-      // the last bytes must always be literals
-      Length numLiterals = BlockEndLiterals;
+      // the last bytes of a block must always be literals
+      const size_t numFinalLiterals = isBlockEnd ? (std::min)(size_t(BlockEndLiterals), end - begin) : 0;
+      Length numLiterals = Length(numFinalLiterals);
+      for (size_t i = end - numFinalLiterals; i < end; ++i) {
+         matches.choices[i] = JustLiteral;
+      }
       // backwards optimal parsing
-      for (int64_t i = int64_t(blockEnd) - (1 + BlockEndLiterals); i >= 0;
-           --i) // ignore the last 5 bytes, they are always literals
-      {
+      for (int64_t i = int64_t(end - numFinalLiterals) - 1; i >= int64_t(begin); --i) {
+         const size_t at = size_t(i) - begin;
          // if encoded as a literal
          ++numLiterals;
          Length bestLength = JustLiteral;
          // such a literal "costs" 1 byte
-         Cost minCost = cost[i + 1] + JustLiteral;
+         Cost minCost = cost[at + 1] + JustLiteral;
 
          // an extra length byte is required for every 255 literals
          if (numLiterals >= 15) {
@@ -369,25 +908,28 @@ struct smallz4
          // let's look at the longest match, almost always more efficient that the plain literals
          const Length match_length = matches.lengths[i];
          const Distance match_distance = matches.distances[i];
+         // part of the match in front of end (there is no match beyond the end of a block)
+         const Length inside = Length((std::min)(uint64_t(match_length), uint64_t(end - i)));
 
          // very long self-referencing matches can slow down the program A LOT
          if (match_length >= MaxSameLetter && match_distance == 1) {
             // assume that longest match is always the best match
             // NOTE: this assumption might not be optimal !
             bestLength = match_length;
-            minCost = cost[i + match_length] + 1 + 2 + 1 + Cost(match_length - 19) / 255;
+            const Cost behind = (match_length == inside) ? cost[at + match_length] : 0;
+            minCost = behind + 1 + 2 + 1 + Cost(match_length - 19) / 255;
          }
          else {
             // this is the core optimization loop
 
             // overhead of encoding a match: token (1 byte) + offset (2 bytes) + sometimes extra bytes for long matches
-            Cost extraCost = 1 + 2;
+            Cost extraCost = 1 + 2 + (match_distance < shortDistance ? shortDistancePenalty : 0);
             Length nextCostIncrease = 18; // need one more byte for 19+ long matches (next increase: 19+255*x)
 
             // try all match lengths (start with short ones)
-            for (Length length = MinMatch; length <= match_length; ++length) {
+            for (Length length = MinMatch; length <= inside; ++length) {
                // token (1 byte) + offset (2 bytes) + extra bytes for long matches
-               Cost currentCost = cost[i + length] + extraCost;
+               Cost currentCost = cost[at + length] + extraCost;
                // better choice ?
                if (currentCost <= minCost) {
                   // regarding the if-condition:
@@ -413,13 +955,25 @@ struct smallz4
                   nextCostIncrease += MaxLengthCode;
                }
             }
+
+            // reaching beyond end ? => bytes beyond end are unknown (cost 0), but cutting the match there would
+            // still require a new match for them, so it continues instead
+            if (match_length > inside && match_length >= MinMatch) {
+               if (inside < MinMatch && extraCost <= minCost) {
+                  minCost = extraCost;
+                  bestLength = inside;
+               }
+               if (bestLength == inside) {
+                  bestLength = match_length;
+               }
+            }
          }
 
          // store lowest cost so far
-         cost[i] = minCost;
+         cost[at] = minCost;
 
          // and adjust best match
-         matches.lengths[i] = bestLength;
+         matches.choices[i] = bestLength;
          
          if (bestLength != JustLiteral) {
             numLiterals = 0; // reset number of literals if a match was chosen
@@ -430,9 +984,73 @@ struct smallz4
       }
    }
 
+   /// how far the output of an in-place decoder advances beyond the block's final distance to the input
+   /** compressed contains the block's LZ4 sequences, writes must not overtake reads while decoding them in place **/
+   static uint64_t inPlaceExcess(std::span<const unsigned char> compressed, uint64_t blockSize)
+   {
+      // difference between decompressed bytes and consumed compressed bytes, measured after each literal run / match
+      int64_t written = 0;
+      size_t pos = 0;
+      int64_t maxDiff = 0;
+      while (pos < compressed.size()) {
+         const unsigned char token = compressed[pos++];
+
+         size_t numLiterals = token >> 4;
+         if (numLiterals == 15) {
+            unsigned char current;
+            do {
+               current = compressed[pos++];
+               numLiterals += current;
+            } while (current == MaxLengthCode && pos < compressed.size());
+         }
+         pos += numLiterals;
+         written += int64_t(numLiterals);
+         maxDiff = (std::max)(maxDiff, written - int64_t(pos));
+         // last token has only literals
+         if (pos >= compressed.size()) break;
+
+         pos += 2; // distance
+         size_t matchLength = MinMatch + (token & 0x0F);
+         if (matchLength == MinMatch + 15) {
+            unsigned char current;
+            do {
+               current = compressed[pos++];
+               matchLength += current;
+            } while (current == MaxLengthCode && pos < compressed.size());
+         }
+         written += int64_t(matchLength);
+         maxDiff = (std::max)(maxDiff, written - int64_t(pos));
+      }
+
+      const int64_t finalDiff = int64_t(blockSize) - int64_t(compressed.size());
+      return maxDiff > finalDiff ? uint64_t(maxDiff - finalDiff) : 0;
+   }
+
+   /// report progress and throw Cancelled if asked to stop
+   void checkpoint(uint64_t done, uint64_t total) const
+   {
+      if (progress) progress(done, total);
+      if (cancelled && cancelled->load(std::memory_order_relaxed)) throw Cancelled();
+   }
+
+  public:
+   /// compress everything between it and end, append LZ4 frame to b (starting at b[ix])
    void compress(const unsigned char*& it, const unsigned char* end, std::string& b, size_t& ix,
-                 const std::vector<unsigned char>& dictionary) const
+                 const std::vector<unsigned char>& dictionary = {})
    {
+      // content-defined chunking ?
+      const bool isChunked = chunkAverageSize > 0;
+      if (isChunked && ((chunkAverageSize & (chunkAverageSize - 1)) != 0 || chunkAverageSize < 64 ||
+                        chunkMinSize > chunkAverageSize || chunkMaxSize < chunkAverageSize ||
+                        chunkMaxSize > MaxBlockSize)) {
+         throw std::runtime_error("invalid chunk sizes");
+      }
+      // several frames ?
+      const bool isCapped = maxFrameSize > 0;
+      if (isCapped && (maxFrameSize < MinFrameSize || restartInterval > 0 || storeBlockIndex)) {
+         throw std::runtime_error("invalid maximum frame size");
+      }
+
       // ==================== write header ====================
       // frame header
       const unsigned char header[] = {
@@ -444,6 +1062,23 @@ struct smallz4
          MaxBlockSizeId << 4, // max blocksize
          0xDF // header checksum (precomputed)
       };
+      SMALLZ4_PROBE1(frame__start, end - it);
+      SMALLZ4_METRICS_ONLY(const auto metricsBegin = std::chrono::steady_clock::now();)
+      const uint64_t totalInput = uint64_t(end - it); // only for progress reports
+      // frame size = flushed + ix - frameBegin
+      const size_t frameBegin = ix;
+      size_t flushed = 0;
+      // only filled if restartInterval > 0
+      std::vector<RestartPoint> restartPoints;
+      // no matches before this position
+      uint64_t segmentBegin = 0;
+      // delimiters in all blocks so far (only counted for chunkDone)
+      uint64_t numRecords = 0;
+      // only filled if storeBlockIndex
+      std::vector<IndexedBlock> indexedBlocks;
+      // current frame's first byte (relative to frameBegin) and its first input byte (only needed if isCapped)
+      uint64_t currentFrame = 0;
+      uint64_t currentFrameInput = 0;
       dump({header, sizeof(header)}, b, ix);
 
       // ==================== declarations ====================
@@ -455,15 +1090,30 @@ struct smallz4
 
       // passthru data ? (but still wrap it in LZ4 format)
       const bool uncompressed = (maxChainLength == 0);
-
-      // last time we saw a hash
-      constexpr uint64_t NoLastHash = ~0; // = -1
-      std::vector<uint64_t> lastHash(HashSize, NoLastHash);
-
-      // previous position which starts with the same bytes
-      std::vector<Distance> previousHash(MaxDistance + 1, Distance(EndOfChain)); // long chains based on my simple hash
-      std::vector<Distance> previousExact(
-         MaxDistance + 1, Distance(EndOfChain)); // shorter chains based on exact matching of the first four bytes
+      // blocks of zeros honor the wild-copy settings, too
+      const uint64_t zeroLeading = (std::max)(uint64_t(1), uint64_t(wildCopyDistance));
+      const uint64_t zeroTrailing = (std::max)(uint64_t(BlockEndLiterals), uint64_t(wildCopyTail));
+
+      // only the most recent 64k of a dictionary are relevant
+      const bool isShared = dictionary.empty() && sharedDictionary != nullptr;
+      std::span<const unsigned char> dictionaryContent = isShared ? sharedDictionary->content : dictionary;
+      if (dictionaryContent.size() > MaxDistance) {
+         dictionaryContent = dictionaryContent.last(MaxDistance);
+      }
+      // input starts after the dictionary
+      const uint64_t inputBegin = dictionaryContent.size();
+
+      // reset match finder (assign() keeps the memory of a previous run)
+      lastHash.assign(HashSize, NoLastHash);
+      previousHash.assign(MaxDistance + 1, Distance(EndOfChain));
+      previousExact.assign(MaxDistance + 1, Distance(EndOfChain));
+      // no need to hash the dictionary again: its positions are looked up in the shared tables while matching
+      const bool useSharedTables = isShared && !dictionaryContent.empty();
+      static_assert(DictionaryHashSize == HashSize && DictionaryChainSize == MaxDistance + 1);
+      sharedLastHash = useSharedTables ? sharedDictionary->lastHash : nullptr;
+      sharedPreviousHash = useSharedTables ? sharedDictionary->previousHash : nullptr;
+      sharedPreviousExact = useSharedTables ? sharedDictionary->previousExact : nullptr;
+      sharedEnd = useSharedTables ? inputBegin : 0;
       // these two containers are essential for match finding:
       // 1. I compute a hash of four byte
       // 2. in lastHash is the location of the most recent block of four byte with that same hash
@@ -490,7 +1140,26 @@ struct smallz4
       // first and last offset of a block (nextBlock is end-of-block plus 1)
       uint64_t lastBlock = 0;
       uint64_t nextBlock = 0;
-      bool parseDictionary = !dictionary.empty();
+      bool parseDictionary = !dictionaryContent.empty();
+
+      // prepend dictionary, copy the beginning of the input behind it so that both are contiguous:
+      // blocks starting within 64k of the dictionary may refer to it, all others only need the original input
+      const unsigned char* const inputData = it;
+      bool inWindow = parseDictionary;
+      if (parseDictionary) {
+         const size_t windowInput = (std::min)(size_t(end - it), size_t(MaxDistance + MaxBlockSize));
+         if (waitForInput) {
+            waitForInput(windowInput);
+         }
+         window.assign(dictionaryContent.begin(), dictionaryContent.end());
+         window.insert(window.end(), it, it + windowInput);
+         it += windowInput;
+
+         data = {window.data(), window.size()};
+         nextBlock = inputBegin;
+         numRead = window.size();
+      }
+      [[maybe_unused]] int64_t blockIndex = -1; // only needed for tracing and probes
 
       // main loop, processes one block per iteration
       while (true) {
@@ -498,23 +1167,14 @@ struct smallz4
          // first byte of the currently processed block (data may contain the last 64k of the previous block, too)
          const unsigned char* dataBlock = nullptr;
          
-         // prepend dictionary
-         if (parseDictionary) {
-            throw std::runtime_error("parseDictionary doesn't work with the single buffer approach, need to add a compile time option for a dictionary buffer");
-            // copy only the most recent 64k of the dictionary
-            if (dictionary.size() < MaxDistance) {
-               data = {dictionary.data(), dictionary.size()};
-            }
-            else {
-               data = {dictionary.data(), MaxDistance};
-            }
-            
-            nextBlock = data.size();
-            numRead = data.size();
+         // the dictionary is out of reach ? => continue with the original input instead of the window
+         if (inWindow && it != end && nextBlock >= inputBegin + MaxDistance) {
+            data = {inputData + (dataZero - inputBegin), size_t(numRead - dataZero)};
+            inWindow = false;
          }
-         
+
          // read more bytes from input
-         if (const size_t incoming = size_t(end - it); incoming)
+         if (const size_t incoming = size_t(end - it); incoming && !inWindow)
          {
             if (data.empty()) {
                data = {it, incoming};
@@ -526,11 +1186,12 @@ struct smallz4
             it += incoming;
          }
          
+         checkpoint(nextBlock - inputBegin, totalInput);
          if (nextBlock == numRead) {
             break; // finished reading
          }
          
-         constexpr size_t maxBlockSize = MaxBlockSize;
+         const size_t maxBlockSize = isChunked ? chunkMaxSize : MaxBlockSize;
          // determine block borders
          lastBlock = nextBlock;
          nextBlock += maxBlockSize;
@@ -538,12 +1199,115 @@ struct smallz4
          if (nextBlock > numRead) {
             nextBlock = numRead;
          }
+
+         // zeros ahead ? => either a block of zeros or a regular block which ends in front of them
+         bool isZeroBlock = false;
+         if (knownZeros && !uncompressed && !parseDictionary) {
+            const uint64_t offset = lastBlock - inputBegin;
+            const ZeroRange zeros = knownZeros(offset);
+            const uint64_t zerosBegin = (std::max)(zeros.begin, offset);
+            if (zeros.end >= zerosBegin + MinZeroRun && inputBegin + zerosBegin < nextBlock) {
+               isZeroBlock = (zerosBegin == offset);
+               nextBlock = isZeroBlock ? (std::min)(nextBlock, inputBegin + zeros.end) : inputBegin + zerosBegin;
+            }
+         }
+
+         // limited frame size: the block's worst case (stored uncompressed) plus the end marker must fit, too
+         bool startsFrame = false;
+         if (isCapped) {
+            constexpr uint64_t Overhead = 4 + 4; // block header and end marker
+            uint64_t frameSize = flushed + ix - frameBegin - currentFrame;
+            uint64_t room = frameSize + Overhead < maxFrameSize ? maxFrameSize - frameSize - Overhead : 0;
+            // not much left ? => new frame, unless the rest of the input fits
+            if (room < nextBlock - lastBlock && room < maxFrameSize / 32) {
+               constexpr uint32_t zero = 0;
+               dump_type(zero, b, ix);
+               if (frameDone) {
+                  frameDone({currentFrame, flushed + ix - frameBegin - currentFrame, currentFrameInput,
+                             lastBlock - inputBegin - currentFrameInput});
+               }
+               currentFrame = flushed + ix - frameBegin;
+               currentFrameInput = lastBlock - inputBegin;
+               dump({header, sizeof(header)}, b, ix);
+               startsFrame = true;
+
+               frameSize = sizeof(header);
+               room = maxFrameSize - frameSize - Overhead;
+            }
+            if (nextBlock - lastBlock > room) {
+               nextBlock = lastBlock + room;
+            }
+         }
+         // too short for encodeZeros()
+         if (nextBlock - lastBlock < MinZeroRun || nextBlock - lastBlock <= zeroLeading + MinMatch + zeroTrailing) {
+            isZeroBlock = false;
+         }
          
+         ++blockIndex;
+         SMALLZ4_TRACE_SCOPE("block", "block", blockIndex);
+
+         // input still arriving ?
+         if (waitForInput) {
+            SMALLZ4_TRACE_SCOPE("read", "block", blockIndex);
+            waitForInput(size_t(nextBlock - inputBegin));
+         }
+
+         // cut block where its content says so
+         if (isChunked && !isZeroBlock) {
+            SMALLZ4_TRACE_SCOPE("chunking", "block", blockIndex);
+            nextBlock = lastBlock + findChunkEnd(&data[lastBlock - dataZero], nextBlock - lastBlock, chunkMinSize,
+                                                 chunkAverageSize, chunkMaxSize);
+         }
+
+         // let the block end with a record
+         if (recordDelimiter >= 0 && nextBlock < numRead && !isZeroBlock) {
+            const unsigned char* const blockData = &data[lastBlock - dataZero];
+            for (uint64_t cut = nextBlock - lastBlock; cut > 0; --cut) {
+               if (blockData[cut - 1] == (unsigned char)recordDelimiter) {
+                  nextBlock = lastBlock + cut;
+                  break;
+               }
+            }
+            // no delimiter at all => a huge record, keep the regular block size
+         }
+         SMALLZ4_PROBE2(block__start, blockIndex, nextBlock - lastBlock);
+
          // pointer to first byte of the currently processed block (the container named data may contain the
          // last 64k of the previous block, too)
          dataBlock = &data[lastBlock - dataZero];
          
          const uint64_t blockSize = nextBlock - lastBlock;
+
+         // forget history ? (each chunk is independent, but the first block may still refer to a dictionary)
+         const bool isRestart = isChunked || startsFrame || storeBlockIndex ||
+                                (restartInterval > 0 && blockIndex % restartInterval == 0);
+         if (isRestart && !parseDictionary) {
+            segmentBegin = lastBlock;
+         }
+         if (restartInterval > 0 && isRestart) {
+            restartPoints.push_back({uint64_t(flushed + ix - frameBegin), lastBlock - inputBegin});
+         }
+
+         // unchanged since the previous version ? => copy its compressed bytes
+         const uint64_t hash = (chunkDone || storeBlockIndex) ? chunkHash(dataBlock, blockSize) : 0;
+         std::span<const unsigned char> reused;
+         if (storeBlockIndex && previousBlock && dictionaryContent.empty() && !isZeroBlock) {
+            reused = previousBlock(hash, uint32_t(blockSize));
+            // must be exactly one block of that size
+            uint32_t tagged = 0;
+            if (reused.size() >= 4) std::memcpy(&tagged, reused.data(), 4);
+            const bool isStored = (tagged & 0x80000000) != 0;
+            tagged &= 0x7FFFFFFF;
+            if (reused.size() < 4 || tagged + 4 != reused.size() || (isStored && tagged != blockSize)) {
+               reused = {};
+            }
+            // same limits for in-place decoding as a freshly compressed block
+            else if (!isStored && inPlaceBlockMargin > 0 &&
+                     inPlaceExcess(reused.subspan(4), blockSize) > inPlaceBlockMargin) {
+               reused = {};
+            }
+         }
+         const bool isReused = !reused.empty();
          
          // ==================== full match finder ====================
          
@@ -556,190 +1320,279 @@ struct smallz4
          Length skipMatches = 0;
          // allow match finding on the next byte but skip afterwards (in lazy mode)
          bool lazyEvaluation = false;
+         // consecutive positions without a match
+         const bool accelerate = (isGreedy || isLazy) && missAcceleration > 0;
+         uint32_t missStreak = 0;
          
+         // no match may start / end too close to the end of the block
+         // (a match starting right in front of noMatchTail must still have room for MinMatch bytes and more)
+         const int64_t literalTail = (std::max)(int64_t(BlockEndLiterals), int64_t(wildCopyTail));
+         const int64_t noMatchTail =
+            (std::max)(int64_t(BlockEndNoMatch), literalTail + (BlockEndNoMatch - BlockEndLiterals));
+
          // the last literals of the previous block skipped matching, so they are missing from the hash chains
          int64_t lookback = int64_t(dataZero);
-         if (lookback > BlockEndNoMatch && !parseDictionary) {
-            lookback = BlockEndNoMatch;
+         if (lookback > noMatchTail && !parseDictionary) {
+            lookback = noMatchTail;
          }
          if (parseDictionary) {
-            lookback = int64_t(dictionary.size());
+            // precomputed tables lack only the dictionary's last 3 positions
+            lookback = isShared ? (std::min)(int64_t(inputBegin), int64_t(MinMatch - 1)) : int64_t(inputBegin);
          }
          // so let's go back a few bytes
          lookback = -lookback;
-         if (uncompressed) {
+         if (uncompressed || isZeroBlock || isReused || (isRestart && !parseDictionary)) {
             lookback = 0;
          }
          
-         const auto n_matches = (uncompressed ? 0 : blockSize);
-         Matches matches;
-         matches.lengths.resize(n_matches);
-         matches.distances.resize(n_matches);
+         // match finding and parsing alternate tile by tile, so that the parser reads each position's match while it's
+         // still cached (matches of positions [matchesBegin, ...) relative to the block's first byte are available)
+         const bool isMatching = !(uncompressed || isZeroBlock || isReused);
+         uint64_t matchesBegin = 0;
+         matches.lengths.clear();
+         matches.distances.clear();
+         // optimal parsing (not needed in greedy mode and/or very short blocks)
+         const bool useCosts = isMatching && blockSize > BlockEndNoMatch && maxChainLength > ShortChainsGreedy;
+         Sequences sequences;
+         if (isMatching) {
+            compressed.resize(blockSize);
+         }
+         // hashing, match finding and parsing alternate, thus their times are accumulated
+         SMALLZ4_TRACE_ONLY(const bool tracing = smallz4_trace::isEnabled(); const uint64_t matchFinderBegin =
+                               tracing ? smallz4_trace::now() : 0;
+                            uint64_t findLongestMatchTime = 0; int64_t findLongestMatchCalls = 0;
+                            uint64_t estimateCostsTime = 0; uint64_t selectBestMatchesTime = 0;)
          // find longest matches for each position (skip if level=0 which means "uncompressed")
-         int64_t i;
-         for (i = lookback; i + BlockEndNoMatch <= int64_t(blockSize) && !uncompressed; ++i) {
-            // detect self-matching
-            if (i > 0 && dataBlock[i] == dataBlock[i - 1]) {
-               // predecessor had the same match ?
-               if (matches.distances[i - 1] == 1) // TODO: handle very long self-referencing matches
-               {
-                  const auto prev_length = matches.lengths[i - 1];
-                  if (prev_length > MaxSameLetter) {
-                     // just copy predecessor without further (expensive) optimizations
-                     matches.distances[i] = 1;
-                     matches.lengths[i] = prev_length - 1;
-                     continue;
+         int64_t i = lookback;
+         int64_t nextCheckpoint = (cancelled || progress) ? CheckpointInterval : INT64_MAX;
+         for (uint64_t tileBegin = 0; isMatching && tileBegin < blockSize; tileBegin += TileSize) {
+            const uint64_t tileEnd = (std::min)(tileBegin + TileSize, blockSize);
+            // no match yet (zero is treated like JustLiteral)
+            matches.lengths.resize(tileEnd - matchesBegin, 0);
+            matches.distances.resize(tileEnd - matchesBegin, 0);
+
+            // positions skipped at the end of the previous tile (greedy / lazy mode) continue here
+            for (; i < int64_t(tileEnd) && i + noMatchTail <= int64_t(blockSize); ++i) {
+               // matches are stored relative to the oldest position the parser still needs
+               const int64_t slot = i - int64_t(matchesBegin);
+               if (i >= nextCheckpoint) {
+                  checkpoint(lastBlock - inputBegin + uint64_t(i), totalInput);
+                  nextCheckpoint = i + CheckpointInterval;
+               }
+
+               // detect self-matching
+               if (i > 0 && dataBlock[i] == dataBlock[i - 1]) {
+                  // predecessor had the same match ?
+                  if (matches.distances[slot - 1] == 1) // TODO: handle very long self-referencing matches
+                  {
+                     const auto prev_length = matches.lengths[slot - 1];
+                     if (prev_length > MaxSameLetter) {
+                        // just copy predecessor without further (expensive) optimizations
+                        matches.distances[slot] = 1;
+                        matches.lengths[slot] = prev_length - 1;
+                        continue;
+                     }
                   }
                }
-            }
-            
-            uint32_t four; // read next four bytes
-            std::memcpy(&four, dataBlock + i, 4);
-            const uint32_t hash = getHash32(four); // convert to a shorter hash
-            
-            uint64_t lastHashMatch = lastHash[hash]; // get most recent position of this hash
-            lastHash[hash] = i + lastBlock; // and store current position
             
-            // remember: i could be negative, too
-            const Distance prevIndex = (i + MaxDistance + 1) & MaxDistance; // actually the same as i & MaxDistance
-            
-            // no predecessor / no hash chain available ?
-            if (lastHashMatch == NoLastHash) {
-               previousHash[prevIndex] = EndOfChain;
-               previousExact[prevIndex] = EndOfChain;
-               continue;
-            }
+               uint32_t four; // read next four bytes
+               std::memcpy(&four, dataBlock + i, 4);
+               // remember: i could be negative, too (but not i + lastBlock)
+               if (!insertPosition(four, uint64_t(i + int64_t(lastBlock)), data.data(), dataZero, segmentBegin)) {
+                  // nothing matched for a while ? => skip a few positions (which aren't hashed either)
+                  if (accelerate && i >= 0 && skipMatches == 0) {
+                     i += (++missStreak) >> missAcceleration;
+                  }
+                  continue;
+               }
             
-            // most recent hash match too far away ?
-            uint64_t distance = lastHash[hash] - lastHashMatch;
-            if (distance > MaxDistance) {
-               previousHash[prevIndex] = EndOfChain;
-               previousExact[prevIndex] = EndOfChain;
-               continue;
-            }
+               // no matching if crossing block boundary, just update hash tables
+               if (i < 0) {
+                  continue;
+               }
             
-            // build hash chain, i.e. store distance to last pseudo-match
-            previousHash[prevIndex] = Distance(distance);
+               // skip match finding if in greedy mode
+               if (skipMatches > 0) {
+                  --skipMatches;
+                  if (!lazyEvaluation) {
+                     continue;
+                  }
+                  lazyEvaluation = false;
+               }
             
-            // skip pseudo-matches (hash collisions) and build a second chain where the first four bytes must match
-            // exactly
-            uint32_t currentFour;
-            // check the hash chain
-            while (true) {
-               // read four bytes
-               std::memcpy(&currentFour, &data[lastHashMatch - dataZero], 4); // match may be found in the previous block, too
-               // match chain found, first 4 bytes are identical
-               if (currentFour == four) {
-                  break;
+               // and after all that preparation ... finally look for the longest match
+               auto& length = matches.lengths[slot];
+               SMALLZ4_TRACE_ONLY(const uint64_t findBegin = tracing ? smallz4_trace::now() : 0;)
+               findLongestMatch(data.data(), i + lastBlock, dataZero, nextBlock - literalTail, previousExact.data(),
+                                length, matches.distances[slot]);
+               // cut short by the end of the block ? => too short for a match
+               if (length < MinMatch) {
+                  length = JustLiteral;
                }
-               
-               // prevent from accidently hopping on an old, wrong hash chain
-               if (hash != getHash32(currentFour)) {
-                  break;
+               SMALLZ4_TRACE_ONLY(if (tracing) {
+                  findLongestMatchTime += smallz4_trace::now() - findBegin;
+                  ++findLongestMatchCalls;
+               })
+
+               // short overlapping copy ? => try a farther distance or give up the match if it isn't worth it
+               if (length != JustLiteral && matches.distances[slot] < wildCopyDistance) {
+                  const unsigned char* const current = dataBlock + i;
+                  const unsigned char* const stop = dataBlock + blockSize - literalTail;
+                  // periodic data repeats at each multiple of its period
+                  const uint32_t distance = matches.distances[slot];
+                  const uint32_t farther = ((wildCopyDistance + distance - 1) / distance) * distance;
+                  Length fartherLength = 0;
+                  const uint64_t oldest = (std::max)(uint64_t(dataZero), segmentBegin);
+                  if (farther <= MaxDistance && i + lastBlock >= farther + oldest) {
+                     const unsigned char* scan = current;
+                     while (scan < stop && *scan == *(scan - farther)) ++scan;
+                     fartherLength = Length(scan - current);
+                  }
+
+                  if (fartherLength >= MinMatch && fartherLength + wildCopyPenalty >= length) {
+                     length = fartherLength;
+                     matches.distances[slot] = Distance(farther);
+                  }
+                  else if (length <= Length(1 + 2 + wildCopyPenalty)) {
+                     // saves too few bytes compared to literals
+                     length = JustLiteral;
+                  }
                }
-               
-               // try next pseudo-match
-               const Distance next = previousHash[lastHashMatch & MaxDistance];
-               // end of the hash chain ?
-               if (next == EndOfChain) {
-                  break;
+            
+               // no match finding needed for the next few bytes in greedy/lazy mode
+               if ((isLazy || isGreedy) && length != JustLiteral) {
+                  lazyEvaluation = (skipMatches == 0);
+                  skipMatches = length;
                }
-               
-               // too far away ?
-               distance += next;
-               if (distance > MaxDistance) {
-                  break;
+
+               // dense search again after a match, otherwise skip ahead if there were many misses
+               if (length != JustLiteral) {
+                  missStreak = 0;
                }
-               
-               // take another step along the hash chain ...
-               lastHashMatch -= next;
-               // closest match is out of range ?
-               if (lastHashMatch < dataZero) {
-                  break;
+               else if (accelerate && skipMatches == 0) {
+                  i += (++missStreak) >> missAcceleration;
                }
             }
-            
-            // search aborted / failed ?
-            if (four != currentFour) {
-               // no matches for the first four bytes
-               previousExact[prevIndex] = EndOfChain;
-               continue;
-            }
-            
-            // store distance to previous match
-            previousExact[prevIndex] = (Distance)distance;
-            
-            // no matching if crossing block boundary, just update hash tables
-            if (i < 0) {
-               continue;
-            }
-            
-            // skip match finding if in greedy mode
-            if (skipMatches > 0) {
-               --skipMatches;
-               if (!lazyEvaluation) {
-                  continue;
+
+            // ==================== estimate costs and select best matches ====================
+
+            // optimal parsing needs to look ahead, choices close to the end of the tile might change later
+            const bool isLastTile = (tileEnd == blockSize);
+            const uint64_t stop = isLastTile ? blockSize
+                                  : useCosts ? (tileEnd > TileLookahead ? tileEnd - TileLookahead : 0)
+                                             : tileEnd;
+            if (sequences.offset < stop) {
+               const Length* choices = matches.lengths.data();
+               if (useCosts) {
+                  SMALLZ4_TRACE_ONLY(const uint64_t costsBegin = tracing ? smallz4_trace::now() : 0;)
+                  estimateCosts(matches, size_t(sequences.offset - matchesBegin), size_t(tileEnd - matchesBegin),
+                                isLastTile, wildCopyDistance, wildCopyPenalty);
+                  choices = matches.choices.data();
+                  SMALLZ4_TRACE_ONLY(if (tracing) estimateCostsTime += smallz4_trace::now() - costsBegin;)
                }
-               lazyEvaluation = false;
+               SMALLZ4_TRACE_ONLY(const uint64_t selectBegin = tracing ? smallz4_trace::now() : 0;)
+               selectBestMatches(choices, matches.distances.data(), matchesBegin, dataBlock, stop, blockSize,
+                                 sequences, compressed);
+               SMALLZ4_TRACE_ONLY(if (tracing) selectBestMatchesTime += smallz4_trace::now() - selectBegin;)
             }
-            
-            // and after all that preparation ... finally look for the longest match
-            auto& length = matches.lengths[i];
-            findLongestMatch(data.data(), i + lastBlock, dataZero, nextBlock - BlockEndLiterals,
-                                          previousExact.data(), length, matches.distances[i]);
-            
-            // no match finding needed for the next few bytes in greedy/lazy mode
-            if ((isLazy || isGreedy) && length != JustLiteral) {
-               lazyEvaluation = (skipMatches == 0);
-               skipMatches = length;
+
+            // drop matches which aren't needed anymore (keep the last one for detecting self-matching)
+            const uint64_t keepFrom = (std::min)(sequences.offset, tileEnd);
+            if (keepFrom > matchesBegin + 1) {
+               const size_t drop = size_t(keepFrom - 1 - matchesBegin);
+               matches.lengths.erase(matches.lengths.begin(), matches.lengths.begin() + drop);
+               matches.distances.erase(matches.distances.begin(), matches.distances.begin() + drop);
+               matchesBegin += drop;
             }
          }
-         // last bytes are always literals
-         const auto n_lengths = int64_t(n_matches);
-         while (i < n_lengths) {
-            matches.lengths[i] = JustLiteral;
-            ++i;
-         }
-         
+         // shown as consecutive events: hash chain updates, findLongestMatch calls, estimateCosts, selectBestMatches
+         SMALLZ4_TRACE_ONLY(if (tracing) {
+            const uint64_t selectBestMatchesEnd = smallz4_trace::now();
+            const uint64_t estimateCostsEnd = selectBestMatchesEnd - selectBestMatchesTime;
+            const uint64_t matchFinderEnd = estimateCostsEnd - estimateCostsTime;
+            const uint64_t hashChainsEnd = matchFinderEnd - findLongestMatchTime;
+            smallz4_trace::record("hash chains", matchFinderBegin, hashChainsEnd, "block", blockIndex);
+            smallz4_trace::record("findLongestMatch", hashChainsEnd, matchFinderEnd, "block", blockIndex, "calls",
+                                  findLongestMatchCalls);
+            smallz4_trace::record("estimateCosts", matchFinderEnd, estimateCostsEnd, "block", blockIndex);
+            smallz4_trace::record("selectBestMatches", estimateCostsEnd, selectBestMatchesEnd, "block", blockIndex);
+         })
+
          // dictionary is valid only to the first block
          parseDictionary = false;
-         
-         // ==================== estimate costs (number of compressed bytes) ====================
-         
-         // not needed in greedy mode and/or very short blocks
-         if (n_matches > BlockEndNoMatch && maxChainLength > ShortChainsGreedy) {
-            estimateCosts(matches);
+
+         if (isZeroBlock) {
+            encodeZeros(blockSize, zeroLeading, zeroTrailing, compressed);
+         }
+         else if (isMatching) {
+            compressed.resize(sequences.ix);
+         }
+         else {
+            compressed.clear();
          }
-         
-         // ==================== select best matches ====================
-         
-         std::vector<unsigned char> compressed{};
-         selectBestMatches(matches, &data[lastBlock - dataZero], compressed);
 
          // ==================== output ====================
 
-         // did compression do harm ?
-         const bool useCompression = compressed.size() < blockSize && !uncompressed;
+         SMALLZ4_TRACE_ONLY(const uint64_t outputBegin = smallz4_trace::now();)
+
+         // did compression do harm ? (or would the block need too much room when decoded in place ?)
+         const bool useCompression =
+            isReused ? (reused[3] & 0x80) == 0
+                     : compressed.size() < blockSize && !uncompressed &&
+                          (inPlaceBlockMargin == 0 || inPlaceExcess(compressed, blockSize) <= inPlaceBlockMargin);
 
          // block size
-         uint32_t numBytes = uint32_t(useCompression ? compressed.size() : blockSize);
-         uint32_t numBytesTagged = numBytes | (useCompression ? 0 : 0x80000000);
-         unsigned char num1 = numBytesTagged & 0xFF;
-         dump(num1, b, ix);
-         unsigned char num2 = (numBytesTagged >> 8) & 0xFF;
-         dump(num2, b, ix);
-         unsigned char num3 = (numBytesTagged >> 16) & 0xFF;
-         dump(num3, b, ix);
-         unsigned char num4 = (numBytesTagged >> 24) & 0xFF;
-         dump(num4, b, ix);
-
-         if (useCompression) {
-            dump({compressed.data(), numBytes}, b, ix);
+         const size_t blockBegin = flushed + ix - frameBegin;
+         uint32_t numBytes = uint32_t(isReused ? reused.size() - 4 : useCompression ? compressed.size() : blockSize);
+         if (isReused) {
+            // block header and payload
+            dump(reused, b, ix);
          }
          else {
-            // uncompressed ? => copy input data
-            dump({&data[lastBlock - dataZero], numBytes}, b, ix);
+            uint32_t numBytesTagged = numBytes | (useCompression ? 0 : 0x80000000);
+            unsigned char num1 = numBytesTagged & 0xFF;
+            dump(num1, b, ix);
+            unsigned char num2 = (numBytesTagged >> 8) & 0xFF;
+            dump(num2, b, ix);
+            unsigned char num3 = (numBytesTagged >> 16) & 0xFF;
+            dump(num3, b, ix);
+            unsigned char num4 = (numBytesTagged >> 24) & 0xFF;
+            dump(num4, b, ix);
+
+            if (useCompression) {
+               dump({compressed.data(), numBytes}, b, ix);
+            }
+            else {
+               // uncompressed ? => copy input data
+               dump({&data[lastBlock - dataZero], numBytes}, b, ix);
+            }
+         }
+
+         if (storeBlockIndex) {
+            indexedBlocks.push_back({blockBegin, 4 + numBytes, uint32_t(blockSize), hash});
+         }
+         if (chunkDone) {
+            const unsigned char delimiter = (unsigned char)recordDelimiter;
+            const uint64_t blockRecords =
+               recordDelimiter < 0 ? 0 : uint64_t(std::count(dataBlock, dataBlock + blockSize, delimiter));
+            chunkDone({lastBlock - inputBegin, uint32_t(blockSize), blockBegin, 4 + numBytes, hash, numRecords,
+                       blockRecords});
+            numRecords += blockRecords;
+         }
+
+         if (flushOutput) {
+            const size_t unflushed = ix;
+            flushOutput(b, ix);
+            flushed += unflushed - ix;
          }
+         SMALLZ4_TRACE_ONLY(smallz4_trace::record("output", outputBegin, smallz4_trace::now(), "block", blockIndex,
+                                                  "bytes", numBytes);)
+         SMALLZ4_PROBE4(block__end, blockIndex, blockSize, numBytes, useCompression ? 1 : 0);
+         SMALLZ4_METRICS_ONLY({
+            smallz4_metrics::add(maxChainLength, smallz4_metrics::Blocks, 1);
+            if (!useCompression) smallz4_metrics::add(maxChainLength, smallz4_metrics::RawBlocks, 1);
+            smallz4_metrics::addSteps(stepHistogram, stepSum);
+         })
 
          // remove already processed data except for the last 64kb which could be used for intra-block matches
          if (data.size() > MaxDistance) {
@@ -751,5 +1604,50 @@ struct smallz4
 
       constexpr uint32_t zero = 0;
       dump_type(zero, b, ix);
+      if (frameDone) {
+         frameDone({currentFrame, flushed + ix - frameBegin - currentFrame, currentFrameInput,
+                    numRead - inputBegin - currentFrameInput});
+      }
+      SMALLZ4_PROBE2(frame__end, numRead - inputBegin, flushed + ix - frameBegin);
+
+      // append block index
+      if (storeBlockIndex) {
+         const uint32_t numBlocks = uint32_t(indexedBlocks.size());
+         const uint32_t payloadSize = numBlocks * 24 + 8 + 4 + 4;
+         dump_type(BlockIndexMagic, b, ix);
+         dump_type(payloadSize, b, ix);
+         for (const auto& block : indexedBlocks) {
+            dump_type(block.compressedOffset, b, ix);
+            dump_type(block.compressedSize, b, ix);
+            dump_type(block.decompressedSize, b, ix);
+            dump_type(block.hash, b, ix);
+         }
+         dump_type(settingsHash(), b, ix);
+         dump_type(numBlocks, b, ix);
+         dump_type(BlockIndexFooter, b, ix);
+      }
+
+      // append restart index (last, so that a decoder finds it at the very end)
+      if (restartInterval > 0) {
+         const uint32_t numPoints = uint32_t(restartPoints.size());
+         const uint32_t payloadSize = numPoints * 16 + 8 + 4 + 4;
+         dump_type(RestartIndexMagic, b, ix);
+         dump_type(payloadSize, b, ix);
+         for (const auto& point : restartPoints) {
+            dump_type(point.compressedOffset, b, ix);
+            dump_type(point.decompressedOffset, b, ix);
+         }
+         dump_type(uint64_t(numRead - inputBegin), b, ix);
+         dump_type(numPoints, b, ix);
+         dump_type(RestartIndexFooter, b, ix);
+      }
+
+      SMALLZ4_METRICS_ONLY({
+         const auto elapsed = std::chrono::steady_clock::now() - metricsBegin;
+         smallz4_metrics::add(maxChainLength, smallz4_metrics::InputBytes, numRead - inputBegin);
+         smallz4_metrics::add(maxChainLength, smallz4_metrics::OutputBytes, flushed + ix - frameBegin);
+         smallz4_metrics::add(maxChainLength, smallz4_metrics::Nanoseconds,
+                              uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+      })
    }
 };
@@ -0,0 +1,192 @@
+// Copyright (c) 2016-2020 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/smallz4/
+// see LICENSE for details
+
+#pragma once
+
+// latency-bounded batching of tiny records into a single LZ4 frame
+// - records are appended to the current batch, which is compressed and emitted when it reaches maxBatchSize bytes or
+//   when its oldest record waited for maxDelay (whatever comes first)
+// - each batch becomes one block (or a few if a huge record exceeds 4 MB) of the same frame, so its matches can refer
+//   to earlier batches: the last 64k of previous batches are the dictionary when compressing the next batch, which is
+//   exactly the history a decoder of linked blocks has, too
+// - hence the output is a standard LZ4 frame with a ratio close to compressing all records at once
+// - all emitted batches concatenated (in order) are the frame, a batch's record offsets are decompressed offsets
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "smallz4.hpp"
+
+/// accumulate small records and emit them as compressed batches, thread-safe
+class BatchWriter
+{
+  public:
+   /// compressed bytes of one batch
+   struct Batch
+   {
+      std::span<const unsigned char> compressed; // first batch: including frame header, last batch: end marker
+      uint64_t compressedOffset; // relative to the frame's first byte
+      uint64_t decompressedOffset; // first byte of the batch's first record
+      uint64_t decompressedSize;
+      std::span<const uint64_t> recordOffsets; // decompressed offset of each record in this batch
+   };
+   /// receives batches in order (called while the writer is locked, don't call write() from there)
+   using Emit = std::function<void(const Batch& batch)>;
+
+   /// maxBatchSize may be up to 4 MB (bigger batches are split into several blocks), maxDelay = 0 disables the timer
+   /** maxChainLength 65535 = optimal parsing (level 9), a batch is small enough for that **/
+   explicit BatchWriter(Emit newEmit, size_t newMaxBatchSize = 64 * 1024,
+                        std::chrono::milliseconds newMaxDelay = std::chrono::milliseconds(10),
+                        uint16_t maxChainLength = 65535)
+      : emit(std::move(newEmit)), maxBatchSize(newMaxBatchSize), maxDelay(newMaxDelay), compressor(maxChainLength)
+   {
+      if (maxDelay.count() > 0) {
+         timer = std::thread([this] { runTimer(); });
+      }
+   }
+
+   /// emit pending records and the end marker
+   ~BatchWriter() { close(); }
+
+   BatchWriter(const BatchWriter&) = delete;
+   BatchWriter& operator=(const BatchWriter&) = delete;
+
+   /// append a record, return its decompressed offset (throws if already closed)
+   uint64_t write(std::span<const unsigned char> record)
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (closed) throw std::runtime_error("batch writer already closed");
+      const uint64_t offset = batchBegin + pending.size();
+      // first record of a new batch (even an empty record needs a batch that lists its offset)
+      if (records.empty()) {
+         oldest = std::chrono::steady_clock::now();
+         changed.notify_one(); // new deadline
+      }
+      pending.insert(pending.end(), record.begin(), record.end());
+      records.push_back(offset);
+
+      if (pending.size() >= maxBatchSize) {
+         emitBatch();
+      }
+      return offset;
+   }
+
+   /// emit all pending records now
+   void flush()
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      emitBatch();
+   }
+
+   /// emit pending records and finish the frame, further writes are not allowed
+   void close()
+   {
+      {
+         std::unique_lock<std::mutex> lock(mutex);
+         if (closed) return;
+         emitBatch();
+
+         // end marker (and frame header if nothing was written at all)
+         std::string compressed;
+         size_t ix = 0;
+         if (compressedSize == 0) {
+            const unsigned char* none = nullptr;
+            compressor.compress(none, none, compressed, ix);
+         }
+         else {
+            constexpr uint32_t zero = 0;
+            smallz4::dump_type(zero, compressed, ix);
+         }
+         const auto* bytes = reinterpret_cast<const unsigned char*>(compressed.data());
+         emit({{bytes, ix}, compressedSize, batchBegin, 0, {}});
+         compressedSize += ix;
+
+         closed = true;
+         changed.notify_one();
+      }
+      if (timer.joinable()) timer.join();
+   }
+
+  private:
+   /// compress the current batch, mutex must be locked
+   void emitBatch()
+   {
+      if (records.empty()) return;
+
+      // a standalone frame whose dictionary is the previous batches' tail, keep only its blocks
+      std::string& compressed = scratch;
+      size_t ix = 0;
+      const unsigned char* it = pending.data();
+      compressor.compress(it, pending.data() + pending.size(), compressed, ix, history);
+      constexpr size_t HeaderSize = 7;
+      constexpr size_t EndMarkerSize = 4;
+      const size_t skip = compressedSize == 0 ? 0 : HeaderSize;
+      const auto* bytes = reinterpret_cast<const unsigned char*>(compressed.data());
+      const std::span<const unsigned char> blocks(bytes + skip, ix - EndMarkerSize - skip);
+
+      emit({blocks, compressedSize, batchBegin, pending.size(), records});
+      compressedSize += blocks.size();
+      batchBegin += pending.size();
+
+      // keep the last 64k as history of the next batch
+      constexpr size_t MaxHistory = 65535;
+      if (pending.size() >= MaxHistory) {
+         history.assign(pending.end() - MaxHistory, pending.end());
+      }
+      else {
+         const size_t keep = (std::min)(history.size(), MaxHistory - pending.size());
+         history.erase(history.begin(), history.end() - keep);
+         history.insert(history.end(), pending.begin(), pending.end());
+      }
+
+      pending.clear();
+      records.clear();
+   }
+
+   /// emit a batch once its oldest record waited long enough
+   void runTimer()
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!closed) {
+         if (records.empty()) {
+            changed.wait(lock);
+            continue;
+         }
+         const auto deadline = oldest + maxDelay;
+         if (std::chrono::steady_clock::now() >= deadline) {
+            emitBatch();
+         }
+         else {
+            changed.wait_until(lock, deadline);
+         }
+      }
+   }
+
+   Emit emit;
+   size_t maxBatchSize;
+   std::chrono::milliseconds maxDelay;
+
+   std::mutex mutex;
+   std::condition_variable changed; // first record of a new batch or closed
+   smallz4 compressor;
+   std::string scratch;
+   std::vector<unsigned char> history; // last 64k of all batches so far
+   std::vector<unsigned char> pending; // current batch
+   std::vector<uint64_t> records; // decompressed offsets of the current batch's records
+   std::chrono::steady_clock::time_point oldest; // when the current batch's first record arrived
+   uint64_t batchBegin = 0; // decompressed offset of the current batch
+   uint64_t compressedSize = 0; // bytes emitted so far
+   bool closed = false;
+
+   std::thread timer; // last member: starts after all others are initialized
+};
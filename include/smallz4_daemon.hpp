@@ -0,0 +1,246 @@
+// Copyright (c) 2016-2020 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/smallz4/
+// see LICENSE for details
+
+#pragma once
+
+// client library of smallz4d, a local compression daemon (Linux only, see src/daemon/smallz4d.cpp)
+// - short-lived processes hand their data to the daemon, which keeps warm smallz4 contexts (no 8 MB lastHash
+//   allocation per job, hot caches)
+// - each client creates a shared-memory region (memfd) with numSlots slots of slotSize bytes and passes it to the
+//   daemon over a Unix socket, which then serves as control channel for job requests and completions
+// - a job's input is written into its slot, its output is written by the daemon into the same slot right behind the
+//   input (64 byte aligned), so neither side copies payload through the socket
+// - up to numSlots jobs can be in flight per client, they may finish in any order
+// - the daemon trusts its clients (same user): its socket lives in a private directory (0700) of the user's runtime
+//   directory, and both sides check the peer's user ID (SO_PEERCRED) before sharing any memory
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+/// default location of the daemon's socket: $XDG_RUNTIME_DIR/smallz4d/smallz4d.sock (or /run/user/<uid>/...)
+/** the daemon creates the smallz4d directory with permissions 0700 **/
+inline std::string daemonDefaultSocket()
+{
+   const char* runtime = getenv("XDG_RUNTIME_DIR");
+   const std::string directory =
+      (runtime && runtime[0] == '/') ? std::string(runtime) : "/run/user/" + std::to_string(geteuid());
+   return directory + "/smallz4d/smallz4d.sock";
+}
+
+/// true if the other end of a Unix socket runs as the same user
+inline bool daemonSameUser(int fd)
+{
+   ucred credentials{};
+   socklen_t size = sizeof(credentials);
+   return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == 0 && size == sizeof(credentials) &&
+          credentials.uid == geteuid();
+}
+
+// ----- control messages (fixed size, native byte order) -----
+
+static constexpr uint32_t DaemonMagic = 0x445A5334; // "4SZD"
+
+/// client => daemon, the region's file descriptor is attached (SCM_RIGHTS)
+struct DaemonHello
+{
+   uint32_t magic;
+   uint32_t numSlots;
+   uint64_t slotSize;
+};
+
+enum class DaemonOperation : uint32_t
+{
+   Compress = 1,
+   Decompress = 2
+};
+
+enum class DaemonStatus : uint32_t
+{
+   Ok = 0,
+   OutputTooLarge = 1, // output doesn't fit into the slot
+   InvalidInput = 2, // e.g. corrupted LZ4 data
+   InvalidRequest = 3 // e.g. unknown operation, slot out of range
+};
+
+/// client => daemon
+struct DaemonRequest
+{
+   uint32_t slot;
+   DaemonOperation operation;
+   uint32_t level; // compression level 0 ... 9 (ignored when decompressing)
+   uint32_t reserved;
+   uint64_t inputSize; // bytes at the beginning of the slot
+};
+
+/// daemon => client (after DaemonHello: slot = ~0, status = accepted or not)
+struct DaemonResponse
+{
+   uint32_t slot;
+   DaemonStatus status;
+   uint64_t outputOffset; // relative to the slot's first byte
+   uint64_t outputSize;
+};
+
+/// where the output of a job with inputSize bytes begins inside its slot
+inline uint64_t daemonOutputOffset(uint64_t inputSize)
+{
+   return (inputSize + 63) & ~uint64_t(63);
+}
+
+/// send or receive a whole control message, return false if the connection was closed
+inline bool daemonTransfer(int fd, void* data, size_t numBytes, bool isSend)
+{
+   unsigned char* bytes = static_cast<unsigned char*>(data);
+   while (numBytes > 0) {
+      const ssize_t done = isSend ? send(fd, bytes, numBytes, MSG_NOSIGNAL) : recv(fd, bytes, numBytes, 0);
+      if (done <= 0) return false;
+      bytes += done;
+      numBytes -= size_t(done);
+   }
+   return true;
+}
+
+/// connection to smallz4d, not thread-safe (use one per thread)
+class DaemonClient
+{
+  public:
+   /// result of a finished job, output points into the shared region (valid until its slot is reused)
+   struct Result
+   {
+      uint32_t slot;
+      DaemonStatus status;
+      std::span<const unsigned char> output;
+   };
+
+   /// connect and share a new region with the daemon, throws std::runtime_error
+   /** socketPath = nullptr: daemonDefaultSocket() **/
+   explicit DaemonClient(const char* socketPath = nullptr, uint32_t newNumSlots = 4,
+                         uint64_t newSlotSize = 16 * 1024 * 1024)
+      : numSlots(newNumSlots), slotSize(newSlotSize)
+   {
+      const std::string defaultSocket = socketPath ? std::string() : daemonDefaultSocket();
+      if (!socketPath) socketPath = defaultSocket.c_str();
+
+      if (numSlots == 0 || slotSize < 64) throw std::runtime_error("invalid shared region");
+
+      const int region = memfd_create("smallz4-client", MFD_CLOEXEC);
+      if (region < 0) throw std::runtime_error("cannot create shared region");
+      if (ftruncate(region, off_t(numSlots * slotSize)) != 0) {
+         close(region);
+         throw std::runtime_error("cannot create shared region");
+      }
+      void* mapped = mmap(nullptr, numSlots * slotSize, PROT_READ | PROT_WRITE, MAP_SHARED, region, 0);
+      if (mapped == MAP_FAILED) {
+         close(region);
+         throw std::runtime_error("cannot map shared region");
+      }
+      base = static_cast<unsigned char*>(mapped);
+
+      sockaddr_un address{};
+      address.sun_family = AF_UNIX;
+      std::strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+      connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (connection < 0 || connect(connection, (const sockaddr*)&address, sizeof(address)) != 0) {
+         close(region);
+         cleanup();
+         throw std::runtime_error("cannot connect to smallz4d");
+      }
+      // never hand the region to somebody else's process
+      if (!daemonSameUser(connection)) {
+         close(region);
+         cleanup();
+         throw std::runtime_error("smallz4d runs as a different user");
+      }
+
+      // hand the region over, the daemon maps it, too
+      DaemonHello hello{DaemonMagic, numSlots, slotSize};
+      iovec payload{&hello, sizeof(hello)};
+      alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+      msghdr message{};
+      message.msg_iov = &payload;
+      message.msg_iovlen = 1;
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+      cmsghdr* attached = CMSG_FIRSTHDR(&message);
+      attached->cmsg_level = SOL_SOCKET;
+      attached->cmsg_type = SCM_RIGHTS;
+      attached->cmsg_len = CMSG_LEN(sizeof(int));
+      std::memcpy(CMSG_DATA(attached), &region, sizeof(int));
+      const bool sent = sendmsg(connection, &message, MSG_NOSIGNAL) == ssize_t(sizeof(hello));
+      close(region);
+
+      DaemonResponse accepted;
+      if (!sent || !daemonTransfer(connection, &accepted, sizeof(accepted), false) ||
+          accepted.status != DaemonStatus::Ok) {
+         cleanup();
+         throw std::runtime_error("smallz4d refused connection");
+      }
+   }
+
+   ~DaemonClient() { cleanup(); }
+
+   DaemonClient(const DaemonClient&) = delete;
+   DaemonClient& operator=(const DaemonClient&) = delete;
+
+   uint32_t getNumSlots() const { return numSlots; }
+
+   /// write a job's input here (zero-copy), the whole slot is available
+   std::span<unsigned char> slot(uint32_t index) { return {base + uint64_t(index) * slotSize, slotSize}; }
+
+   /// start a job whose input was written to the beginning of its slot, throws std::runtime_error
+   void submit(uint32_t index, DaemonOperation operation, uint64_t inputSize, int level = 9)
+   {
+      if (index >= numSlots || inputSize > slotSize) throw std::runtime_error("invalid job");
+      DaemonRequest request{index, operation, uint32_t(level), 0, inputSize};
+      if (!daemonTransfer(connection, &request, sizeof(request), true)) throw std::runtime_error("smallz4d is gone");
+   }
+
+   /// block until the next job finishes (in any order), throws std::runtime_error if the daemon is gone
+   Result wait()
+   {
+      DaemonResponse response;
+      if (!daemonTransfer(connection, &response, sizeof(response), false) || response.slot >= numSlots ||
+          response.outputOffset + response.outputSize > slotSize) {
+         throw std::runtime_error("smallz4d is gone");
+      }
+      const unsigned char* output = base + uint64_t(response.slot) * slotSize + response.outputOffset;
+      return {response.slot, response.status, {output, size_t(response.outputSize)}};
+   }
+
+   /// synchronous convenience wrapper: copy input to slot 0, run the job and wait for it
+   Result run(DaemonOperation operation, std::span<const unsigned char> input, int level = 9)
+   {
+      if (input.size() > slotSize) throw std::runtime_error("input doesn't fit into a slot");
+      std::memcpy(base, input.data(), input.size());
+      submit(0, operation, input.size(), level);
+      return wait();
+   }
+
+  private:
+   void cleanup()
+   {
+      if (connection >= 0) close(connection);
+      if (base) munmap(base, numSlots * slotSize);
+      connection = -1;
+      base = nullptr;
+   }
+
+   uint32_t numSlots;
+   uint64_t slotSize;
+   unsigned char* base = nullptr;
+   int connection = -1;
+};
+
+#endif
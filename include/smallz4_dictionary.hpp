@@ -0,0 +1,130 @@
+// Copyright (c) 2016-2020 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/smallz4/
+// see LICENSE for details
+
+#pragma once
+
+// precomputed dictionary: the match finder's tables after hashing a dictionary, stored in a file
+// - processes map that file read-only, so all of them share the same physical pages (page cache)
+// - a compressor looks up the dictionary's positions in these tables instead of hashing the dictionary again,
+//   nothing is copied (its own tables only hold the input's positions)
+// - tables are stored in native byte order, the file is meant to be shared on a single host
+//
+// file layout (all offsets are fixed):
+//   0     header: SharedDictionaryMagic, version, hash table size, chain size, content size (4 bytes each)
+//   64    content: the dictionary's last bytes (at most 65535, zero-padded to 65536)
+//   65600 previousHash:  65536 x uint16_t
+//   196672 previousExact: 65536 x uint16_t
+//   327744 lastHash: 2^20 x uint32_t
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include "smallz4.hpp"
+
+/// read-only mapping of a precomputed dictionary
+class SharedDictionary
+{
+  public:
+   static constexpr uint32_t SharedDictionaryMagic = 0x44345A53; // "SZ4D"
+   static constexpr uint32_t Version = 1;
+
+   /// hash a dictionary (only its last 64k are relevant) and write a new file, throws std::runtime_error
+   static void save(const char* filename, std::span<const unsigned char> dictionary)
+   {
+      if (dictionary.size() > MaxContentSize) {
+         dictionary = dictionary.last(MaxContentSize);
+      }
+
+      std::vector<unsigned char> file(FileSize, 0);
+      const uint32_t header[] = {SharedDictionaryMagic, Version, uint32_t(smallz4::DictionaryHashSize),
+                                 uint32_t(smallz4::DictionaryChainSize), uint32_t(dictionary.size())};
+      std::memcpy(file.data(), header, sizeof(header));
+      if (!dictionary.empty()) {
+         std::memcpy(file.data() + ContentOffset, dictionary.data(), dictionary.size());
+      }
+      smallz4::buildDictionaryTables(dictionary, reinterpret_cast<uint32_t*>(file.data() + LastHashOffset),
+                                     reinterpret_cast<uint16_t*>(file.data() + PreviousHashOffset),
+                                     reinterpret_cast<uint16_t*>(file.data() + PreviousExactOffset));
+
+      FILE* out = fopen(filename, "wb");
+      if (!out) throw std::runtime_error("cannot create precomputed dictionary");
+      const size_t numWritten = fwrite(file.data(), 1, file.size(), out);
+      if (fclose(out) != 0 || numWritten != file.size()) {
+         throw std::runtime_error("cannot write precomputed dictionary");
+      }
+   }
+
+   /// true if a file starts like a precomputed dictionary
+   static bool isSharedDictionary(const char* filename)
+   {
+      FILE* in = fopen(filename, "rb");
+      if (!in) return false;
+      uint32_t magic = 0;
+      const bool ok = fread(&magic, sizeof(magic), 1, in) == 1 && magic == SharedDictionaryMagic;
+      fclose(in);
+      return ok;
+   }
+
+   /// map a file written by save(), throws std::runtime_error
+   explicit SharedDictionary(const char* filename)
+   {
+      const int fd = open(filename, O_RDONLY);
+      if (fd < 0) throw std::runtime_error("cannot open precomputed dictionary");
+
+      struct stat info;
+      if (fstat(fd, &info) != 0 || size_t(info.st_size) != FileSize) {
+         close(fd);
+         throw std::runtime_error("invalid precomputed dictionary");
+      }
+      mapping = mmap(nullptr, FileSize, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (mapping == MAP_FAILED) throw std::runtime_error("cannot map precomputed dictionary");
+
+      const unsigned char* base = static_cast<const unsigned char*>(mapping);
+      uint32_t header[5];
+      std::memcpy(header, base, sizeof(header));
+      if (header[0] != SharedDictionaryMagic || header[1] != Version || header[2] != smallz4::DictionaryHashSize ||
+          header[3] != smallz4::DictionaryChainSize || header[4] > MaxContentSize) {
+         munmap(mapping, FileSize);
+         throw std::runtime_error("invalid precomputed dictionary");
+      }
+
+      view.content = {base + ContentOffset, header[4]};
+      view.lastHash = reinterpret_cast<const uint32_t*>(base + LastHashOffset);
+      view.previousHash = reinterpret_cast<const uint16_t*>(base + PreviousHashOffset);
+      view.previousExact = reinterpret_cast<const uint16_t*>(base + PreviousExactOffset);
+   }
+
+   ~SharedDictionary() { munmap(mapping, FileSize); }
+
+   SharedDictionary(const SharedDictionary&) = delete;
+   SharedDictionary& operator=(const SharedDictionary&) = delete;
+
+   /// assign to smallz4::sharedDictionary (valid as long as this object exists)
+   const smallz4::DictionaryTables& tables() const { return view; }
+
+  private:
+   static constexpr size_t MaxContentSize = 65535;
+   static constexpr size_t ContentOffset = 64;
+   static constexpr size_t PreviousHashOffset = ContentOffset + 65536;
+   static constexpr size_t PreviousExactOffset = PreviousHashOffset + smallz4::DictionaryChainSize * sizeof(uint16_t);
+   static constexpr size_t LastHashOffset = PreviousExactOffset + smallz4::DictionaryChainSize * sizeof(uint16_t);
+   static constexpr size_t FileSize = LastHashOffset + smallz4::DictionaryHashSize * sizeof(uint32_t);
+
+   void* mapping = nullptr;
+   smallz4::DictionaryTables view{};
+};
+
+#endif
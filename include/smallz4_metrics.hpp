@@ -0,0 +1,224 @@
+// Copyright (c) 2016-2020 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/smallz4/
+// see LICENSE for details
+
+#pragma once
+
+// optional process-wide metrics in OpenMetrics text format (e.g. scraped by Prometheus)
+// - compile with -DSMALLZ4_METRICS, otherwise all SMALLZ4_METRICS_* macros expand to nothing
+// - counters are sharded: each thread adds to its own cache-line-aligned shard with relaxed atomics, only render()
+//   sums up all shards, so that worker pools don't fight over the same cache lines
+// - the compressor updates its counters once per block and once per frame, match finder chain steps are collected
+//   per block in the smallz4 object and added to the histogram afterwards
+// - compression counters are labeled by level (0 ... 9, "custom" for other chain lengths), throughput is
+//   rate(input bytes) / rate(seconds)
+// - decoders count frames, bytes and errors (errors which terminate the command-line tool are not counted)
+
+#ifdef SMALLZ4_METRICS
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+
+struct smallz4_metrics
+{
+   /// compression levels 0 ... 9 plus one slot for all other chain lengths
+   static constexpr unsigned NumLevels = 11;
+   /// chain steps histogram: bucket k holds 2^(k-1) ... 2^k - 1 steps (bucket 0 holds zero steps)
+   static constexpr unsigned NumStepBuckets = 18;
+
+   /// counters of one compression level
+   enum LevelCounter
+   {
+      InputBytes,
+      OutputBytes,
+      Nanoseconds,
+      Blocks,
+      RawBlocks, // block was stored uncompressed (level 0 or compression didn't pay off)
+      NumLevelCounters
+   };
+
+   /// decoder counters
+   enum DecodeCounter
+   {
+      DecodeFrames,
+      DecodeInputBytes,
+      DecodeOutputBytes,
+      DecodeErrors,
+      NumDecodeCounters
+   };
+
+   /// per-block histogram of match finder chain steps, filled by a single compressor without any synchronization
+   using StepHistogram = std::array<uint64_t, NumStepBuckets>;
+
+   /// histogram bucket of a number of chain steps
+   static unsigned stepBucket(uint32_t numSteps)
+   {
+      unsigned bucket = 0;
+      while (numSteps > 0 && bucket + 1 < NumStepBuckets) {
+         numSteps >>= 1;
+         ++bucket;
+      }
+      return bucket;
+   }
+
+   /// map a maximum chain length to a level slot
+   static unsigned levelSlot(uint16_t maxChainLength)
+   {
+      if (maxChainLength == 65535) return 9;
+      return maxChainLength < 9 ? maxChainLength : NumLevels - 1;
+   }
+
+   static void add(uint16_t maxChainLength, LevelCounter counter, uint64_t value)
+   {
+      shard().levels[levelSlot(maxChainLength)][counter].fetch_add(value, std::memory_order_relaxed);
+   }
+
+   static void add(DecodeCounter counter, uint64_t value)
+   {
+      shard().decode[counter].fetch_add(value, std::memory_order_relaxed);
+   }
+
+   /// add a block's chain steps and reset them
+   static void addSteps(StepHistogram& histogram, uint64_t& sum)
+   {
+      Shard& current = shard();
+      for (unsigned bucket = 0; bucket < NumStepBuckets; ++bucket) {
+         if (histogram[bucket] > 0) current.steps[bucket].fetch_add(histogram[bucket], std::memory_order_relaxed);
+         histogram[bucket] = 0;
+      }
+      current.stepSum.fetch_add(sum, std::memory_order_relaxed);
+      sum = 0;
+   }
+
+   /// sum of a level counter over all shards
+   static uint64_t total(unsigned level, LevelCounter counter)
+   {
+      uint64_t result = 0;
+      for (const Shard& current : shards()) result += current.levels[level][counter].load(std::memory_order_relaxed);
+      return result;
+   }
+
+   /// sum of a decoder counter over all shards
+   static uint64_t total(DecodeCounter counter)
+   {
+      uint64_t result = 0;
+      for (const Shard& current : shards()) result += current.decode[counter].load(std::memory_order_relaxed);
+      return result;
+   }
+
+   /// produce OpenMetrics text, which is passed to callback in several pieces
+   static void render(const std::function<void(const std::string&)>& callback)
+   {
+      auto levelFamily = [&](const char* name, const char* type, const char* unit, const char* help,
+                             LevelCounter counter, double scale) {
+         std::string text = std::string("# TYPE ") + name + " " + type + "\n";
+         if (*unit) text += std::string("# UNIT ") + name + " " + unit + "\n";
+         text += std::string("# HELP ") + name + " " + help + "\n";
+         for (unsigned level = 0; level < NumLevels; ++level) {
+            // skip unused levels, but keep zeros of used levels (rates need them)
+            if (total(level, Blocks) == 0 && total(level, InputBytes) == 0) continue;
+            const uint64_t value = total(level, counter);
+            const std::string label = level + 1 < NumLevels ? std::to_string(level) : "custom";
+            char number[32];
+            snprintf(number, sizeof(number), scale == 1 ? "%.0f" : "%.9f", value * scale);
+            text += std::string(name) + "_total{level=\"" + label + "\"} " + number + "\n";
+         }
+         callback(text);
+      };
+      levelFamily("smallz4_compress_input_bytes", "counter", "bytes", "Uncompressed bytes read by the compressor.",
+                  InputBytes, 1);
+      levelFamily("smallz4_compress_output_bytes", "counter", "bytes", "Compressed bytes written by the compressor.",
+                  OutputBytes, 1);
+      levelFamily("smallz4_compress_seconds", "counter", "seconds", "Time spent compressing frames.", Nanoseconds,
+                  1e-9);
+      levelFamily("smallz4_compress_blocks", "counter", "", "Blocks written by the compressor.", Blocks, 1);
+      levelFamily("smallz4_compress_raw_blocks", "counter", "",
+                  "Blocks stored uncompressed (level 0 or compression didn't pay off).", RawBlocks, 1);
+
+      // cumulative buckets
+      std::string text = "# TYPE smallz4_match_chain_steps histogram\n"
+                         "# HELP smallz4_match_chain_steps Match chain entries visited per match finder call.\n";
+      uint64_t cumulative = 0;
+      uint64_t sum = 0;
+      for (const Shard& current : shards()) sum += current.stepSum.load(std::memory_order_relaxed);
+      for (unsigned bucket = 0; bucket < NumStepBuckets; ++bucket) {
+         for (const Shard& current : shards()) cumulative += current.steps[bucket].load(std::memory_order_relaxed);
+         const std::string upper = bucket + 1 < NumStepBuckets ? std::to_string((uint64_t(1) << bucket) - 1) : "+Inf";
+         text += "smallz4_match_chain_steps_bucket{le=\"" + upper + "\"} " + std::to_string(cumulative) + "\n";
+      }
+      text += "smallz4_match_chain_steps_count " + std::to_string(cumulative) + "\n";
+      text += "smallz4_match_chain_steps_sum " + std::to_string(sum) + "\n";
+      callback(text);
+
+      auto decodeFamily = [&](const char* name, const char* unit, const char* help, DecodeCounter counter) {
+         std::string family = std::string("# TYPE ") + name + " counter\n";
+         if (*unit) family += std::string("# UNIT ") + name + " " + unit + "\n";
+         family += std::string("# HELP ") + name + " " + help + "\n";
+         family += std::string(name) + "_total " + std::to_string(total(counter)) + "\n";
+         callback(family);
+      };
+      decodeFamily("smallz4_decode_frames", "", "Frames decoded (or rejected).", DecodeFrames);
+      decodeFamily("smallz4_decode_input_bytes", "bytes", "Compressed bytes consumed by decoders.", DecodeInputBytes);
+      decodeFamily("smallz4_decode_output_bytes", "bytes", "Decompressed bytes produced by decoders.",
+                   DecodeOutputBytes);
+      decodeFamily("smallz4_decode_errors", "", "Frames rejected as malformed.", DecodeErrors);
+
+      callback("# EOF\n");
+   }
+
+   /// all metrics as OpenMetrics text
+   static std::string render()
+   {
+      std::string result;
+      render([&result](const std::string& text) { result += text; });
+      return result;
+   }
+
+   /// write all metrics to a file, return false on failure
+   static bool save(const char* filename)
+   {
+      FILE* out = fopen(filename, "wb");
+      if (!out) return false;
+      render([out](const std::string& text) { fwrite(text.data(), 1, text.size(), out); });
+      return fclose(out) == 0;
+   }
+
+  private:
+   /// all counters of one thread (or a few threads if there are more threads than shards)
+   struct alignas(64) Shard
+   {
+      std::atomic<uint64_t> levels[NumLevels][NumLevelCounters] = {};
+      std::atomic<uint64_t> steps[NumStepBuckets] = {};
+      std::atomic<uint64_t> stepSum{0};
+      std::atomic<uint64_t> decode[NumDecodeCounters] = {};
+   };
+   static constexpr unsigned NumShards = 16;
+
+   static std::array<Shard, NumShards>& shards()
+   {
+      static std::array<Shard, NumShards> instance;
+      return instance;
+   }
+
+   /// threads are assigned to shards round-robin
+   static Shard& shard()
+   {
+      static std::atomic<unsigned> numThreads{0};
+      thread_local Shard& mine = shards()[numThreads++ % NumShards];
+      return mine;
+   }
+};
+
+/// execute a statement only if metrics are compiled in
+#define SMALLZ4_METRICS_ONLY(...) __VA_ARGS__
+
+#else
+
+#define SMALLZ4_METRICS_ONLY(...)
+
+#endif
@@ -0,0 +1,50 @@
+// Copyright (c) 2016-2020 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/smallz4/
+// see LICENSE for details
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+/// number of workers parallelFor() will actually use
+inline unsigned parallelWorkers(size_t numTasks, unsigned numWorkers)
+{
+   if (numWorkers == 0) {
+      numWorkers = (std::max)(1u, std::thread::hardware_concurrency());
+   }
+   return unsigned((std::min)(size_t(numWorkers), (std::max)(numTasks, size_t(1))));
+}
+
+/// bounded worker pool: run task(worker, index) for each index in [0, numTasks)
+/** - at most numWorkers threads are started (0 means: one per hardware thread)
+    - each worker pulls the next index from a shared counter, so that small and large tasks balance themselves
+    - worker is in [0, numWorkers), use it to pick a per-worker context (e.g. a reusable smallz4 compressor)
+    - task must not throw, store errors per index instead (that way they can be reported in input order) **/
+template <typename Task>
+void parallelFor(size_t numTasks, unsigned numWorkers, Task&& task)
+{
+   numWorkers = parallelWorkers(numTasks, numWorkers);
+
+   std::atomic<size_t> next{0};
+   auto work = [&](unsigned worker) {
+      for (size_t index = next++; index < numTasks; index = next++) {
+         task(worker, index);
+      }
+   };
+
+   // the calling thread is worker 0
+   std::vector<std::thread> threads;
+   threads.reserve(numWorkers);
+   for (unsigned worker = 1; worker < numWorkers; ++worker) {
+      threads.emplace_back(work, worker);
+   }
+   work(0);
+
+   for (auto& thread : threads) {
+      thread.join();
+   }
+}
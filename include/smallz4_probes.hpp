@@ -0,0 +1,36 @@
+// Copyright (c) 2016-2020 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/smallz4/
+// see LICENSE for details
+
+#pragma once
+
+// optional USDT static tracepoints (Linux, sys/sdt.h from SystemTap), e.g. for bpftrace:
+//   bpftrace -e 'usdt:./compress:smallz4:block__end { @ratio = hist(arg2 * 100 / arg1); }'
+// - compile with -DSMALLZ4_USDT, otherwise the probes expand to nothing and sys/sdt.h isn't needed
+// - a probe costs a single NOP while no tracer is attached
+//
+// provider "smallz4", probes and their arguments:
+//   frame__start        (input size)
+//   frame__end          (input size, output size)
+//   block__start        (block index, block size)
+//   block__end          (block index, block size, stored size, compressed ? 1 : 0)
+//   decode__block__start(block index, stored size, compressed ? 1 : 0)
+//   decode__block__end  (block index, stored size, compressed ? 1 : 0)
+
+#if defined(SMALLZ4_USDT) && defined(__linux__)
+
+#include <sys/sdt.h>
+
+#define SMALLZ4_PROBE1(name, a) DTRACE_PROBE1(smallz4, name, a)
+#define SMALLZ4_PROBE2(name, a, b) DTRACE_PROBE2(smallz4, name, a, b)
+#define SMALLZ4_PROBE3(name, a, b, c) DTRACE_PROBE3(smallz4, name, a, b, c)
+#define SMALLZ4_PROBE4(name, a, b, c, d) DTRACE_PROBE4(smallz4, name, a, b, c, d)
+
+#else
+
+#define SMALLZ4_PROBE1(name, a)
+#define SMALLZ4_PROBE2(name, a, b)
+#define SMALLZ4_PROBE3(name, a, b, c)
+#define SMALLZ4_PROBE4(name, a, b, c, d)
+
+#endif
@@ -0,0 +1,219 @@
+// Copyright (c) 2016-2020 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/smallz4/
+// see LICENSE for details
+
+#pragma once
+
+// compressed in-memory flight recorder: keep the most recent log data for post-mortems
+// - appended records are collected in an uncompressed segment of segmentSize bytes, a full segment is compressed by
+//   a helper thread (the appending threads only copy bytes into the current segment)
+// - each segment is compressed on its own (no matches into earlier segments), so the oldest segment can be evicted
+//   whenever the compressed segments would exceed their budget
+// - a segment holds whole records unless a record is larger than a segment
+// - dump() produces a standard LZ4 frame: all retained segments' blocks plus the current segment, oldest first
+// - memory usage: maxCompressed bytes for compressed segments, up to MaxSealed + 1 uncompressed segments and the
+//   compressor's tables
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "smallz4.hpp"
+
+/// ring buffer of independently compressed segments, evicts the oldest segment when full, thread-safe
+class FlightRecorder
+{
+  public:
+   /// what is currently held
+   struct Stats
+   {
+      uint64_t retainedBytes; // decompressed size of all retained data (including the current segment)
+      uint64_t compressedBytes; // compressed segments only
+      uint64_t evictedBytes; // decompressed size of all evicted segments
+      uint64_t numSegments; // compressed segments
+   };
+
+   /// keep at most maxCompressed bytes of compressed segments (but at least the newest segment),
+   /// segmentSize must be between 1k and 4 MB, throws std::runtime_error
+   explicit FlightRecorder(size_t newMaxCompressed, size_t newSegmentSize = 1024 * 1024, uint16_t maxChainLength = 1)
+      : maxCompressed(newMaxCompressed), segmentSize(newSegmentSize), compressor(maxChainLength)
+   {
+      if (segmentSize < 1024 || segmentSize > MaxSegmentSize) throw std::runtime_error("invalid segment size");
+      current.reserve(segmentSize);
+      helper = std::thread([this] { run(); });
+   }
+
+   ~FlightRecorder()
+   {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         done = true;
+         changed.notify_all();
+      }
+      helper.join();
+   }
+
+   FlightRecorder(const FlightRecorder&) = delete;
+   FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+   /// append a record (blocks only if the helper thread can't keep up)
+   void append(std::span<const unsigned char> record)
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      // keep records in one piece if possible
+      if (!current.empty() && current.size() + record.size() > segmentSize) seal(lock);
+
+      while (!record.empty()) {
+         const size_t numBytes = (std::min)(record.size(), segmentSize - current.size());
+         current.insert(current.end(), record.begin(), record.begin() + numBytes);
+         record = record.subspan(numBytes);
+         if (current.size() == segmentSize) seal(lock);
+      }
+   }
+
+   /// append a record
+   void append(const std::string& record)
+   {
+      append({reinterpret_cast<const unsigned char*>(record.data()), record.size()});
+   }
+
+   /// write all retained data as an LZ4 frame to b (starting at b[ix]), oldest first
+   void dump(std::string& b, size_t& ix)
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      // compressor is idle afterwards and all sealed segments were added
+      idle.wait(lock, [this] { return sealed.empty() && !isCompressing; });
+
+      // the compressor's frame header and end marker, all segments' blocks in between
+      std::string compressed;
+      size_t numBytes = 0;
+      const unsigned char* it = current.data();
+      compressor.compress(it, current.data() + current.size(), compressed, numBytes);
+      const auto* bytes = reinterpret_cast<const unsigned char*>(compressed.data());
+
+      smallz4::dump({bytes, HeaderSize}, b, ix);
+      for (const auto& segment : segments) smallz4::dump({segment.compressed.data(), segment.compressed.size()}, b, ix);
+      smallz4::dump({bytes + HeaderSize, numBytes - HeaderSize}, b, ix);
+   }
+
+   /// write all retained data to an .lz4 file, return false on failure
+   bool save(const char* filename)
+   {
+      std::string b;
+      size_t ix = 0;
+      dump(b, ix);
+
+      FILE* file = fopen(filename, "wb");
+      if (!file) return false;
+      const bool ok = fwrite(b.data(), 1, ix, file) == ix;
+      return fclose(file) == 0 && ok;
+   }
+
+   /// current usage
+   Stats stats()
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      Stats result{current.size() + compressingSize, compressedBytes, evictedBytes, segments.size()};
+      for (const auto& segment : segments) result.retainedBytes += segment.decompressedSize;
+      for (const auto& pending : sealed) result.retainedBytes += pending.size();
+      return result;
+   }
+
+  private:
+   /// frame header of smallz4::compress (no content size, no dictionary ID)
+   static constexpr size_t HeaderSize = 7;
+   static constexpr size_t EndMarkerSize = 4;
+   /// one block per segment
+   static constexpr size_t MaxSegmentSize = 4 * 1024 * 1024;
+   /// appending blocks if that many full segments wait for compression
+   static constexpr size_t MaxSealed = 2;
+
+   struct Segment
+   {
+      std::vector<unsigned char> compressed; // blocks only, without frame header and end marker
+      size_t decompressedSize;
+   };
+
+   /// hand the current segment over to the helper thread, mutex must be locked
+   void seal(std::unique_lock<std::mutex>& lock)
+   {
+      idle.wait(lock, [this] { return sealed.size() < MaxSealed; });
+      sealed.push_back(std::move(current));
+
+      // recycle an old buffer
+      if (!spare.empty()) {
+         current = std::move(spare.back());
+         spare.pop_back();
+      }
+      else {
+         current = {};
+         current.reserve(segmentSize);
+      }
+      changed.notify_all();
+   }
+
+   /// compress sealed segments and evict the oldest ones
+   void run()
+   {
+      std::string compressed; // reused for all segments
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+         changed.wait(lock, [this] { return done || !sealed.empty(); });
+         if (sealed.empty()) return;
+
+         std::vector<unsigned char> data = std::move(sealed.front());
+         sealed.pop_front();
+         isCompressing = true;
+         compressingSize = data.size();
+         lock.unlock();
+
+         size_t ix = 0;
+         const unsigned char* it = data.data();
+         compressor.compress(it, data.data() + data.size(), compressed, ix);
+         const auto* bytes = reinterpret_cast<const unsigned char*>(compressed.data());
+         Segment segment{{bytes + HeaderSize, bytes + ix - EndMarkerSize}, data.size()};
+
+         lock.lock();
+         compressedBytes += segment.compressed.size();
+         segments.push_back(std::move(segment));
+         while (compressedBytes > maxCompressed && segments.size() > 1) {
+            compressedBytes -= segments.front().compressed.size();
+            evictedBytes += segments.front().decompressedSize;
+            segments.pop_front();
+         }
+
+         data.clear();
+         spare.push_back(std::move(data));
+         isCompressing = false;
+         compressingSize = 0;
+         idle.notify_all();
+      }
+   }
+
+   size_t maxCompressed;
+   size_t segmentSize;
+
+   std::mutex mutex;
+   std::condition_variable changed; // segment sealed or shutting down
+   std::condition_variable idle; // segment compressed
+   smallz4 compressor; // only used by the helper thread, or by dump() while the helper thread is idle
+   std::vector<unsigned char> current; // uncompressed, still growing
+   std::deque<std::vector<unsigned char>> sealed; // full, waiting for compression
+   std::vector<std::vector<unsigned char>> spare; // recycled buffers
+   std::deque<Segment> segments; // compressed, oldest first
+   uint64_t compressedBytes = 0;
+   uint64_t evictedBytes = 0;
+   bool isCompressing = false;
+   size_t compressingSize = 0; // segment the helper thread is working on, neither sealed nor in segments
+   bool done = false;
+
+   std::thread helper; // started by the constructor after all others are initialized
+};
@@ -0,0 +1,148 @@
+// Copyright (c) 2016-2020 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/smallz4/
+// see LICENSE for details
+
+#pragma once
+
+// optional timeline of compression stages in Chrome's trace-event format (open in https://ui.perfetto.dev or
+// chrome://tracing)
+// - compile with -DSMALLZ4_TRACE, otherwise all SMALLZ4_TRACE_* macros expand to nothing
+// - recording starts with smallz4_trace::enable() and is written by smallz4_trace::save(filename)
+// - each event carries the ID of the thread which produced it, so pipelines and worker pools can be compared
+
+#ifdef SMALLZ4_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+struct smallz4_trace
+{
+   /// a complete ("X") event, times in nanoseconds since enable()
+   struct Event
+   {
+      const char* name; // must be a string literal
+      uint64_t begin;
+      uint64_t end;
+      uint32_t thread;
+      const char* argName; // optional (nullptr)
+      int64_t argValue;
+      const char* argName2; // optional (nullptr)
+      int64_t argValue2;
+   };
+
+   /// start recording (discards older events)
+   static void enable()
+   {
+      std::lock_guard<std::mutex> lock(state().mutex);
+      state().events.clear();
+      state().epoch = std::chrono::steady_clock::now();
+      state().enabled = true;
+   }
+
+   /// stop recording
+   static void disable() { state().enabled = false; }
+
+   static bool isEnabled() { return state().enabled.load(std::memory_order_relaxed); }
+
+   /// nanoseconds since enable()
+   static uint64_t now()
+   {
+      return uint64_t(
+         std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - state().epoch)
+            .count());
+   }
+
+   /// small sequential thread IDs are easier to read in a viewer than native ones
+   static uint32_t threadId()
+   {
+      static std::atomic<uint32_t> numThreads{0};
+      thread_local const uint32_t id = ++numThreads;
+      return id;
+   }
+
+   /// store an event (no-op if disabled)
+   static void record(const char* name, uint64_t begin, uint64_t end, const char* argName = nullptr,
+                      int64_t argValue = 0, const char* argName2 = nullptr, int64_t argValue2 = 0)
+   {
+      if (!isEnabled()) return;
+
+      const Event event{name, begin, end, threadId(), argName, argValue, argName2, argValue2};
+      std::lock_guard<std::mutex> lock(state().mutex);
+      state().events.push_back(event);
+   }
+
+   /// write all events as trace-event JSON, return false on failure
+   static bool save(const char* filename)
+   {
+      FILE* out = fopen(filename, "wb");
+      if (!out) return false;
+
+      std::lock_guard<std::mutex> lock(state().mutex);
+      fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+      bool first = true;
+      for (const Event& event : state().events) {
+         // timestamps are microseconds
+         fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"smallz4\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                 first ? "" : ",\n", event.name, event.thread, event.begin / 1000.0,
+                 (event.end - event.begin) / 1000.0);
+         if (event.argName) {
+            fprintf(out, ",\"args\":{\"%s\":%lld", event.argName, (long long)event.argValue);
+            if (event.argName2) {
+               fprintf(out, ",\"%s\":%lld", event.argName2, (long long)event.argValue2);
+            }
+            fputc('}', out);
+         }
+         fputc('}', out);
+         first = false;
+      }
+      fputs("\n]}\n", out);
+      return fclose(out) == 0;
+   }
+
+   /// RAII helper: records an event from construction until destruction
+   struct Scope
+   {
+      const char* name;
+      uint64_t begin;
+      const char* argName;
+      int64_t argValue;
+
+      explicit Scope(const char* newName, const char* newArgName = nullptr, int64_t newArgValue = 0)
+         : name(newName), begin(now()), argName(newArgName), argValue(newArgValue)
+      {}
+      ~Scope() { record(name, begin, now(), argName, argValue); }
+   };
+
+  private:
+   struct State
+   {
+      std::atomic<bool> enabled{false};
+      std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+      std::mutex mutex;
+      std::vector<Event> events;
+   };
+
+   static State& state()
+   {
+      static State instance;
+      return instance;
+   }
+};
+
+#define SMALLZ4_TRACE_CONCAT2(a, b) a##b
+#define SMALLZ4_TRACE_CONCAT(a, b) SMALLZ4_TRACE_CONCAT2(a, b)
+/// record an event until the end of the current scope, optionally with one numeric argument
+#define SMALLZ4_TRACE_SCOPE(...) smallz4_trace::Scope SMALLZ4_TRACE_CONCAT(smallz4TraceScope, __LINE__)(__VA_ARGS__)
+/// execute a statement only if tracing is compiled in
+#define SMALLZ4_TRACE_ONLY(...) __VA_ARGS__
+
+#else
+
+#define SMALLZ4_TRACE_SCOPE(...)
+#define SMALLZ4_TRACE_ONLY(...)
+
+#endif
@@ -0,0 +1,356 @@
+// Copyright (c) 2016-2020 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/smallz4/
+// see LICENSE for details
+
+#pragma once
+
+// optional Linux I/O backend: io_uring with O_DIRECT (bypasses the page cache)
+// - compile with -DSMALLZ4_IO_URING, no liburing needed (raw system calls)
+// - several block-sized reads/writes stay in flight while the compressor works on the current block
+// - filesystems without O_DIRECT support (e.g. tmpfs) silently fall back to buffered I/O, still via io_uring
+
+#if defined(__linux__) && defined(SMALLZ4_IO_URING)
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/// minimal io_uring wrapper: queue reads/writes, wait for their completion
+class Uring
+{
+  public:
+   explicit Uring(unsigned entries)
+   {
+      io_uring_params params{};
+      fd = int(syscall(__NR_io_uring_setup, entries, &params));
+      if (fd < 0) throw std::runtime_error("io_uring not available");
+
+      sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+      if (singleMap) {
+         sqSize = cqSize = (std::max)(sqSize, cqSize);
+      }
+
+      sqRing = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      cqRing = singleMap ? sqRing
+                         : mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                IORING_OFF_CQ_RING);
+      sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+      sqes = (io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                 IORING_OFF_SQES);
+      if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+         close(fd);
+         throw std::runtime_error("cannot map io_uring");
+      }
+
+      unsigned char* sq = (unsigned char*)sqRing;
+      sqTail = (unsigned*)(sq + params.sq_off.tail);
+      sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+      sqArray = (unsigned*)(sq + params.sq_off.array);
+      unsigned char* cq = (unsigned char*)cqRing;
+      cqHead = (unsigned*)(cq + params.cq_off.head);
+      cqTail = (unsigned*)(cq + params.cq_off.tail);
+      cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+      cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+      capacity = params.sq_entries;
+   }
+
+   ~Uring()
+   {
+      munmap(sqes, sqesSize);
+      if (cqRing != sqRing) munmap(cqRing, cqSize);
+      munmap(sqRing, sqSize);
+      close(fd);
+   }
+
+   Uring(const Uring&) = delete;
+   Uring& operator=(const Uring&) = delete;
+
+   /// queue a read (IORING_OP_READ) or write (IORING_OP_WRITE), it's submitted by the next wait()
+   void prepare(uint8_t opcode, int file, void* buffer, uint32_t numBytes, uint64_t offset, uint64_t userData)
+   {
+      if (inFlight == capacity) throw std::runtime_error("io_uring queue full");
+
+      const unsigned tail = *sqTail; // only this thread writes the tail
+      const unsigned index = tail & sqMask;
+      io_uring_sqe& sqe = sqes[index];
+      std::memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = opcode;
+      sqe.fd = file;
+      sqe.addr = uint64_t(uintptr_t(buffer));
+      sqe.len = numBytes;
+      sqe.off = offset;
+      sqe.user_data = userData;
+      sqArray[index] = index;
+      __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+      ++toSubmit;
+      ++inFlight;
+   }
+
+   /// submit queued requests and block until one of them is finished, result is the number of bytes or -errno
+   void wait(uint64_t& userData, int& result)
+   {
+      while (true) {
+         const unsigned head = *cqHead;
+         if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) && toSubmit == 0) {
+            const io_uring_cqe& cqe = cqes[head & cqMask];
+            userData = cqe.user_data;
+            result = cqe.res;
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            --inFlight;
+            return;
+         }
+
+         const long ret = syscall(__NR_io_uring_enter, fd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+         if (ret < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("io_uring_enter failed");
+         }
+         toSubmit -= unsigned(ret);
+      }
+   }
+
+   /// number of requests which were queued but aren't finished yet
+   unsigned pending() const { return inFlight; }
+
+  private:
+   int fd = -1;
+   void* sqRing = nullptr;
+   void* cqRing = nullptr;
+   io_uring_sqe* sqes = nullptr;
+   size_t sqSize = 0;
+   size_t cqSize = 0;
+   size_t sqesSize = 0;
+   unsigned* sqTail = nullptr;
+   unsigned* sqArray = nullptr;
+   unsigned sqMask = 0;
+   unsigned* cqHead = nullptr;
+   unsigned* cqTail = nullptr;
+   io_uring_cqe* cqes = nullptr;
+   unsigned cqMask = 0;
+   unsigned capacity = 0;
+   unsigned toSubmit = 0;
+   unsigned inFlight = 0;
+};
+
+/// O_DIRECT needs aligned buffers, offsets and sizes
+static constexpr size_t UringAlignment = 4096;
+/// each read or write covers one LZ4 block
+static constexpr size_t UringChunkSize = 4 * 1024 * 1024;
+/// number of reads (or writes) in flight
+static constexpr unsigned UringQueueDepth = 4;
+
+/// open with O_DIRECT, fall back to buffered I/O if the filesystem refuses
+inline int openDirect(const char* filename, int flags, bool& isDirect)
+{
+   int fd = open(filename, flags | O_DIRECT, 0644);
+   isDirect = (fd >= 0);
+   if (fd < 0 && errno == EINVAL) {
+      fd = open(filename, flags, 0644);
+   }
+   return fd;
+}
+
+/// read a whole file into a (virtual) buffer, UringQueueDepth chunks ahead of the consumer
+/** pages more than 64k behind the consumer are released, so memory usage doesn't grow with the file size **/
+class UringReader
+{
+  public:
+   explicit UringReader(const char* filename) : ring(UringQueueDepth)
+   {
+      fd = openDirect(filename, O_RDONLY, isDirect);
+      if (fd < 0) throw std::runtime_error("cannot read file");
+
+      struct stat info;
+      if (fstat(fd, &info) != 0) {
+         close(fd);
+         throw std::runtime_error("cannot read file");
+      }
+      fileSize = size_t(info.st_size);
+
+      // reserve address space only, pages are allocated when a read arrives
+      mappedSize = (fileSize + UringChunkSize - 1) / UringChunkSize * UringChunkSize;
+      if (mappedSize > 0) {
+         buffer = (unsigned char*)mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+         if (buffer == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("out of memory");
+         }
+      }
+
+      numChunks = mappedSize / UringChunkSize;
+      finished.assign(numChunks, false);
+      submitReads();
+   }
+
+   ~UringReader()
+   {
+      if (mappedSize > 0) munmap(buffer, mappedSize);
+      close(fd);
+   }
+
+   const unsigned char* data() const { return buffer; }
+   size_t size() const { return fileSize; }
+
+   /// block until the first numBytes are available
+   void waitFor(size_t numBytes)
+   {
+      // release everything the compressor can't reach anymore (64k before the previous block)
+      constexpr size_t Window = 65536;
+      if (consumed > Window) {
+         const size_t releaseUpTo = (consumed - Window) / UringAlignment * UringAlignment;
+         if (releaseUpTo > released) {
+            madvise(buffer + released, releaseUpTo - released, MADV_DONTNEED);
+            released = releaseUpTo;
+         }
+      }
+      consumed = numBytes;
+
+      while (available < numBytes) {
+         uint64_t chunk;
+         int result;
+         ring.wait(chunk, result);
+
+         const size_t offset = size_t(chunk) * UringChunkSize;
+         const size_t expected = (std::min)(UringChunkSize, fileSize - offset);
+         if (result < 0 || size_t(result) != expected) throw std::runtime_error("read failed");
+         finished[chunk] = true;
+
+         // contiguous data grew ?
+         while (available < fileSize && finished[available / UringChunkSize]) {
+            available = (std::min)(available + UringChunkSize, fileSize);
+         }
+         submitReads();
+      }
+   }
+
+  private:
+   /// keep UringQueueDepth reads in flight
+   void submitReads()
+   {
+      while (nextChunk < numChunks && ring.pending() < UringQueueDepth) {
+         const size_t offset = nextChunk * UringChunkSize;
+         // O_DIRECT reads whole chunks (the last one, too), the kernel stops at the end of file
+         ring.prepare(IORING_OP_READ, fd, buffer + offset, uint32_t(UringChunkSize), offset, nextChunk);
+         ++nextChunk;
+      }
+   }
+
+   Uring ring;
+   int fd = -1;
+   bool isDirect = false;
+   unsigned char* buffer = nullptr;
+   size_t fileSize = 0;
+   size_t mappedSize = 0;
+   size_t numChunks = 0;
+   size_t nextChunk = 0;
+   std::vector<bool> finished;
+   size_t available = 0; // the first "available" bytes were read
+   size_t consumed = 0; // last value of waitFor()
+   size_t released = 0; // pages before this offset were given back to the OS
+};
+
+/// write a file through UringQueueDepth aligned staging buffers
+class UringWriter
+{
+  public:
+   explicit UringWriter(const char* filename) : ring(UringQueueDepth)
+   {
+      fd = openDirect(filename, O_WRONLY | O_CREAT | O_TRUNC, isDirect);
+      if (fd < 0) throw std::runtime_error("cannot write file");
+
+      for (auto& staging : buffers) {
+         if (posix_memalign((void**)&staging, UringAlignment, UringChunkSize) != 0) {
+            throw std::runtime_error("out of memory");
+         }
+      }
+   }
+
+   ~UringWriter()
+   {
+      for (auto staging : buffers) free(staging);
+      close(fd);
+   }
+
+   /// copy to the current staging buffer, a full buffer is written asynchronously
+   void append(const unsigned char* data, size_t numBytes)
+   {
+      while (numBytes > 0) {
+         const size_t now = (std::min)(numBytes, UringChunkSize - fill);
+         std::memcpy(buffers[current] + fill, data, now);
+         fill += now;
+         data += now;
+         numBytes -= now;
+
+         if (fill == UringChunkSize) {
+            submitCurrent(UringChunkSize);
+         }
+      }
+   }
+
+   /// write remaining data and wait until everything is on disk
+   void finish()
+   {
+      const size_t total = offset + fill;
+      if (fill > 0) {
+         // O_DIRECT needs a multiple of the alignment, the file is truncated afterwards
+         const size_t padded = isDirect ? (fill + UringAlignment - 1) / UringAlignment * UringAlignment : fill;
+         std::memset(buffers[current] + fill, 0, padded - fill);
+         submitCurrent(padded);
+      }
+      while (ring.pending() > 0) {
+         reap();
+      }
+      if (isDirect && ftruncate(fd, off_t(total)) != 0) throw std::runtime_error("cannot write file");
+   }
+
+  private:
+   void submitCurrent(size_t numBytes)
+   {
+      ring.prepare(IORING_OP_WRITE, fd, buffers[current], uint32_t(numBytes), offset, current);
+      busy[current] = numBytes;
+      offset += fill;
+      fill = 0;
+      current = (current + 1) % UringQueueDepth;
+      // next staging buffer still in flight ?
+      while (busy[current] > 0) {
+         reap();
+      }
+   }
+
+   /// wait for any write to finish
+   void reap()
+   {
+      uint64_t index;
+      int result;
+      ring.wait(index, result);
+      if (result < 0 || size_t(result) != busy[index]) throw std::runtime_error("write failed");
+      busy[index] = 0;
+   }
+
+   Uring ring;
+   int fd = -1;
+   bool isDirect = false;
+   unsigned char* buffers[UringQueueDepth] = {};
+   size_t busy[UringQueueDepth] = {}; // size of a staging buffer's pending write, 0 if idle
+   unsigned current = 0; // staging buffer which is currently filled
+   size_t fill = 0; // bytes in current staging buffer
+   size_t offset = 0; // file offset of current staging buffer
+};
+
+#endif
@@ -0,0 +1,207 @@
+// Copyright (c) 2016-2020 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/smallz4/
+// see LICENSE for details
+
+#pragma once
+
+// round-trip verification which overlaps with compression
+// - each finished block is copied (it's small compared to the time spent on compressing it) and handed to a helper
+//   thread, which decodes it and compares the result against the block's source bytes
+// - meanwhile the compressor continues with the next block, so verification hardly adds wall-clock time
+// - a block's history is taken from the source (and dictionary): if all previous blocks round-trip, the decoder would
+//   have exactly those bytes, too, therefore each block can be checked on its own and failures are reported per block
+// - the block's source bytes and their history are copied when the block is queued, because the source may be released
+//   as soon as the compressor moved on (e.g. UringReader drops pages older than 64k)
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "smallz4.hpp"
+
+/// decode each finished block on a helper thread while the compressor is busy with the next one
+class BlockVerifier
+{
+  public:
+   /// source's blocks must be valid until they were queued, dictionary is the compressor's dictionary (if any)
+   BlockVerifier(std::span<const unsigned char> newSource, std::span<const unsigned char> newDictionary = {})
+      : source(newSource), dictionary(newDictionary), helper([this] { run(); })
+   {}
+
+   ~BlockVerifier() { stop(); }
+
+   BlockVerifier(const BlockVerifier&) = delete;
+   BlockVerifier& operator=(const BlockVerifier&) = delete;
+
+   /// verify every block the compressor emits into b (chunkDone is chained, restore it after compress() returned)
+   void watch(smallz4& context, const std::string& b, const size_t& ix)
+   {
+      auto previous = context.chunkDone;
+      context.chunkDone = [this, previous, &b, &ix](const smallz4::Chunk& chunk) {
+         // chunkDone is invoked right after the block was dumped, so it's the last thing in the output buffer
+         add(chunk, reinterpret_cast<const unsigned char*>(b.data()) + ix - chunk.compressedSize);
+         if (previous) previous(chunk);
+      };
+   }
+
+   /// queue a block for verification, block points to its 4 byte block header
+   void add(const smallz4::Chunk& chunk, const unsigned char* block)
+   {
+      Job job{chunk, std::vector<unsigned char>(block, block + chunk.compressedSize), {}, 0};
+
+      // history: up to 64k in front of the block, taken from the dictionary and the source, followed by the block
+      const uint64_t offset = chunk.decompressedOffset;
+      const size_t size = chunk.decompressedSize;
+      if (offset + size <= source.size()) {
+         constexpr size_t MaxHistory = 65535;
+         const size_t fromSource = size_t((std::min)(offset, uint64_t(MaxHistory)));
+         const size_t fromDictionary = (std::min)(dictionary.size(), MaxHistory - fromSource);
+         job.expected.reserve(fromDictionary + fromSource + size);
+         job.expected.insert(job.expected.end(), dictionary.end() - fromDictionary, dictionary.end());
+         job.expected.insert(job.expected.end(), source.begin() + (offset - fromSource),
+                             source.begin() + (offset + size));
+         job.historySize = fromDictionary + fromSource;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(std::move(job));
+      changed.notify_one();
+   }
+
+   /// wait until all queued blocks are verified, return one message per failed block (empty if all are fine)
+   std::vector<std::string> finish()
+   {
+      stop();
+      return failures;
+   }
+
+  private:
+   struct Job
+   {
+      smallz4::Chunk chunk;
+      std::vector<unsigned char> block; // including block header
+      std::vector<unsigned char> expected; // history followed by the block's source bytes (empty if out of range)
+      size_t historySize;
+   };
+
+   void stop()
+   {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         done = true;
+         changed.notify_one();
+      }
+      if (helper.joinable()) helper.join();
+   }
+
+   void run()
+   {
+      std::vector<unsigned char> decoded; // reused for all blocks
+      while (true) {
+         Job job;
+         {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return done || !jobs.empty(); });
+            if (jobs.empty()) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+         }
+
+         const char* error = verify(job, decoded);
+         if (error) {
+            failures.push_back("block at offset " + std::to_string(job.chunk.decompressedOffset) + " (" +
+                               std::to_string(job.chunk.decompressedSize) + " bytes): " + error);
+         }
+      }
+   }
+
+   /// decode a block behind its history and compare with the source, return nullptr if it round-trips
+   static const char* verify(const Job& job, std::vector<unsigned char>& decoded)
+   {
+      const size_t size = job.chunk.decompressedSize;
+      if (job.expected.size() != job.historySize + size) return "outside of source";
+
+      decoded.assign(job.expected.begin(), job.expected.begin() + job.historySize);
+      decoded.reserve(job.expected.size());
+      const size_t blockBegin = decoded.size();
+
+      if (job.block.size() < 4) return "truncated block header";
+      uint32_t numBytes;
+      std::memcpy(&numBytes, job.block.data(), 4);
+      const bool isCompressed = (numBytes & 0x80000000) == 0;
+      numBytes &= 0x7FFFFFFF;
+      if (size_t(numBytes) + 4 != job.block.size()) return "block size mismatch";
+
+      const unsigned char* it = job.block.data() + 4;
+      const unsigned char* end = it + numBytes;
+      if (!isCompressed) {
+         decoded.insert(decoded.end(), it, end);
+      }
+      else {
+         while (it != end) {
+            const unsigned char token = *it++;
+
+            // literals
+            size_t numLiterals = token >> 4;
+            if (numLiterals == 15) {
+               unsigned char current;
+               do {
+                  if (it == end) return "truncated literal length";
+                  current = *it++;
+                  numLiterals += current;
+               } while (current == 255);
+            }
+            if (numLiterals > size_t(end - it)) return "literals beyond end of block";
+            if (decoded.size() - blockBegin + numLiterals > size) return "too many bytes";
+            decoded.insert(decoded.end(), it, it + numLiterals);
+            it += numLiterals;
+
+            // last token has only literals
+            if (it == end) break;
+
+            // match
+            if (end - it < 2) return "truncated offset";
+            const size_t distance = it[0] | (size_t(it[1]) << 8);
+            it += 2;
+            size_t matchLength = 4 + (token & 0x0F);
+            if (matchLength == 4 + 0x0F) {
+               unsigned char current;
+               do {
+                  if (it == end) return "truncated match length";
+                  current = *it++;
+                  matchLength += current;
+               } while (current == 255);
+            }
+            if (distance == 0 || distance > decoded.size()) return "invalid offset";
+            if (decoded.size() - blockBegin + matchLength > size) return "too many bytes";
+
+            // byte-wise: source and destination may overlap
+            size_t from = decoded.size() - distance;
+            while (matchLength-- > 0) decoded.push_back(decoded[from++]);
+         }
+      }
+
+      if (decoded.size() - blockBegin != size) return "too few bytes";
+      if (std::memcmp(decoded.data() + blockBegin, job.expected.data() + blockBegin, size) != 0)
+         return "content mismatch";
+      return nullptr;
+   }
+
+   std::span<const unsigned char> source;
+   std::span<const unsigned char> dictionary;
+
+   std::mutex mutex;
+   std::condition_variable changed;
+   std::deque<Job> jobs;
+   bool done = false;
+
+   std::vector<std::string> failures; // only accessed by the helper thread until it was joined
+   std::thread helper; // last member: starts after all others are initialized
+};
@@ -0,0 +1,468 @@
+// //////////////////////////////////////////////////////////
+// smallz4d.cpp
+// Copyright (c) 2016-2020 Stephan Brumme. All rights reserved.
+// see https://create.stephan-brumme.com/smallz4/
+// see LICENSE for details
+
+// local compression daemon: serves compress / decompress jobs of many short-lived processes on a warm pool of
+// smallz4 contexts, see smallz4_daemon.hpp for the protocol and the client library
+// usage: smallz4d [-s socket] [-j workers]   (default socket: see daemonDefaultSocket())
+
+#include "smallz4.hpp"
+#include "smallz4_daemon.hpp"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// error handler (startup only, failed jobs are reported to their clients)
+static void daemonError(const char* msg)
+{
+   fputs("ERROR: ", stderr);
+   fputs(msg, stderr);
+   fputc('\n', stderr);
+   exit(1);
+}
+
+/// a client's shared region and control channel
+struct Connection
+{
+   int fd = -1;
+   unsigned char* base = nullptr;
+   uint32_t numSlots = 0;
+   uint64_t slotSize = 0;
+   /// several workers may finish jobs of the same client at the same time
+   std::mutex sendLock;
+   /// client disconnected: its pending jobs are abandoned (running ones stop at their next checkpoint)
+   std::atomic<bool> closed{false};
+
+   ~Connection()
+   {
+      if (base) munmap(base, numSlots * slotSize);
+      if (fd >= 0) close(fd);
+   }
+
+   /// send a completion, silently ignore clients which are gone
+   void reply(const DaemonResponse& response)
+   {
+      std::lock_guard<std::mutex> lock(sendLock);
+      DaemonResponse copy = response;
+      daemonTransfer(fd, &copy, sizeof(copy), true);
+   }
+};
+
+struct Job
+{
+   std::shared_ptr<Connection> connection; // keeps the region mapped until the job is done
+   DaemonRequest request;
+};
+
+/// jobs waiting for a worker
+class JobQueue
+{
+  public:
+   void push(Job job)
+   {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         jobs.push_back(std::move(job));
+      }
+      available.notify_one();
+   }
+
+   Job pop()
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      available.wait(lock, [this] { return !jobs.empty(); });
+      Job job = std::move(jobs.front());
+      jobs.pop_front();
+      return job;
+   }
+
+  private:
+   std::mutex mutex;
+   std::condition_variable available;
+   std::deque<Job> jobs;
+};
+
+/// thrown if a job's output doesn't fit into its slot
+struct OutputTooLarge
+{};
+
+/// thrown if a job's client is gone
+struct JobCancelled
+{};
+
+// ==================== DECOMPRESSION ====================
+
+/// decode all LZ4 frames of [it, end) into out[0, capacity), skippable frames are ignored, return decompressed size
+/** - unlike smallz4cat this decoder must never exit: corrupted input throws std::runtime_error
+    - cancelled is checked before each block and after each MB of output, throws JobCancelled **/
+static uint64_t decodeFrames(const unsigned char* it, const unsigned char* end, unsigned char* out, uint64_t capacity,
+                             const std::atomic<bool>& cancelled)
+{
+   constexpr uint64_t CheckpointInterval = 1024 * 1024;
+   uint64_t pos = 0;
+   uint64_t nextCheckpoint = 0;
+   auto need = [&](uint64_t numBytes) {
+      if (uint64_t(end - it) < numBytes) throw std::runtime_error("out of data");
+   };
+   auto read32 = [&]() {
+      need(4);
+      uint32_t value;
+      std::memcpy(&value, it, 4);
+      it += 4;
+      return value;
+   };
+
+   while (it != end) {
+      const uint32_t signature = read32();
+      // skippable frame
+      if ((signature & 0xFFFFFFF0) == 0x184D2A50) {
+         const uint32_t skip = read32();
+         need(skip);
+         it += skip;
+         continue;
+      }
+      if (signature != 0x184D2204) throw std::runtime_error("invalid signature");
+
+      need(2);
+      const unsigned char flags = it[0];
+      if ((flags >> 6) != 1) throw std::runtime_error("only LZ4 file format version 1 supported");
+      const bool hasBlockChecksum = (flags & 16) != 0;
+      const bool hasContentChecksum = (flags & 4) != 0;
+      const uint64_t headerSize = 1 + 1 + ((flags & 8) ? 8 : 0) + ((flags & 1) ? 4 : 0) + 1;
+      need(headerSize);
+      it += headerSize;
+
+      // history of a frame starts at its first decompressed byte
+      const uint64_t frameBegin = pos;
+      while (true) {
+         uint32_t blockSize = read32();
+         const bool isCompressed = (blockSize & 0x80000000) == 0;
+         blockSize &= 0x7FFFFFFF;
+         if (blockSize == 0) break;
+
+         if (cancelled.load(std::memory_order_relaxed)) throw JobCancelled();
+         need(blockSize + (hasBlockChecksum ? 4 : 0));
+         const unsigned char* const blockEnd = it + blockSize;
+         if (!isCompressed) {
+            if (capacity - pos < blockSize) throw OutputTooLarge();
+            std::memcpy(out + pos, it, blockSize);
+            pos += blockSize;
+            it = blockEnd;
+         }
+         while (it < blockEnd) {
+            if (pos >= nextCheckpoint) {
+               if (cancelled.load(std::memory_order_relaxed)) throw JobCancelled();
+               nextCheckpoint = pos + CheckpointInterval;
+            }
+
+            const unsigned char token = *it++;
+
+            uint64_t numLiterals = token >> 4;
+            if (numLiterals == 15) {
+               unsigned char current;
+               do {
+                  if (it == blockEnd) throw std::runtime_error("invalid block");
+                  current = *it++;
+                  numLiterals += current;
+               } while (current == 255);
+            }
+            if (uint64_t(blockEnd - it) < numLiterals) throw std::runtime_error("invalid block");
+            if (capacity - pos < numLiterals) throw OutputTooLarge();
+            std::memcpy(out + pos, it, numLiterals);
+            pos += numLiterals;
+            it += numLiterals;
+
+            // last token has only literals
+            if (it == blockEnd) break;
+
+            if (blockEnd - it < 2) throw std::runtime_error("invalid block");
+            const uint32_t delta = it[0] | (uint32_t(it[1]) << 8);
+            it += 2;
+            if (delta == 0 || delta > pos - frameBegin) throw std::runtime_error("invalid offset");
+
+            uint64_t matchLength = 4 + (token & 0x0F);
+            if (matchLength == 4 + 15) {
+               unsigned char current;
+               do {
+                  if (it == blockEnd) throw std::runtime_error("invalid block");
+                  current = *it++;
+                  matchLength += current;
+               } while (current == 255);
+            }
+            if (capacity - pos < matchLength) throw OutputTooLarge();
+
+            // overlapping matches must be copied byte-wise
+            const unsigned char* reference = out + pos - delta;
+            if (delta >= matchLength) {
+               std::memcpy(out + pos, reference, matchLength);
+               pos += matchLength;
+            }
+            else {
+               while (matchLength-- > 0) out[pos++] = *reference++;
+            }
+         }
+
+         if (hasBlockChecksum) it += 4; // ignore checksum
+      }
+
+      if (hasContentChecksum) {
+         need(4);
+         it += 4; // ignore checksum
+      }
+   }
+
+   return pos;
+}
+
+// ==================== WORKERS ====================
+
+/// process jobs forever, each worker keeps its compressor (and thus its 8 MB of match finder tables) warm
+static void worker(JobQueue& queue)
+{
+   smallz4 context;
+   std::string scratch;
+
+   while (true) {
+      Job job = queue.pop();
+      const DaemonRequest& request = job.request;
+      Connection& connection = *job.connection;
+
+      unsigned char* const slot = connection.base + uint64_t(request.slot) * connection.slotSize;
+      const uint64_t outputOffset = daemonOutputOffset(request.inputSize);
+      const uint64_t capacity = outputOffset < connection.slotSize ? connection.slotSize - outputOffset : 0;
+      unsigned char* const output = slot + outputOffset;
+
+      // nobody waits for the result anymore
+      if (connection.closed) continue;
+
+      DaemonResponse response{request.slot, DaemonStatus::Ok, outputOffset, 0};
+      context.cancelled = &connection.closed;
+      try {
+         if (request.operation == DaemonOperation::Compress) {
+            context.setMaxChainLength(request.level >= 9 ? 65535 : uint16_t(request.level));
+
+            // copy each finished block from the compressor's buffer to the shared region
+            uint64_t written = 0;
+            auto flush = [&](std::string& b, size_t& ix) {
+               if (capacity - written < ix) throw OutputTooLarge();
+               std::memcpy(output + written, b.data(), ix);
+               written += ix;
+               ix = 0;
+            };
+            context.flushOutput = flush;
+
+            const unsigned char* it = slot;
+            size_t ix = 0;
+            context.compress(it, slot + request.inputSize, scratch, ix);
+            // end marker
+            flush(scratch, ix);
+            response.outputSize = written;
+         }
+         else if (request.operation == DaemonOperation::Decompress) {
+            response.outputSize = decodeFrames(slot, slot + request.inputSize, output, capacity, connection.closed);
+         }
+         else {
+            response.status = DaemonStatus::InvalidRequest;
+         }
+      }
+      catch (const OutputTooLarge&) {
+         response.status = DaemonStatus::OutputTooLarge;
+      }
+      catch (const JobCancelled&) {
+         connection.closed = true;
+      }
+      catch (const smallz4::Cancelled&) {
+         connection.closed = true;
+      }
+      catch (const std::exception&) {
+         response.status = DaemonStatus::InvalidInput;
+      }
+      context.flushOutput = nullptr;
+      context.cancelled = nullptr;
+      if (connection.closed) continue;
+
+      if (response.status != DaemonStatus::Ok) {
+         response.outputSize = 0;
+      }
+      connection.reply(response);
+   }
+}
+
+// ==================== CLIENTS ====================
+
+/// handshake and then forward all requests of a client to the workers
+static void serveClient(int fd, JobQueue& queue)
+{
+   auto connection = std::make_shared<Connection>();
+   connection->fd = fd;
+
+   // clients share their memory and get access to the workers, only the daemon's own user may do that
+   if (!daemonSameUser(fd)) return;
+
+   // receive shared region
+   DaemonHello hello{};
+   iovec payload{&hello, sizeof(hello)};
+   alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+   msghdr message{};
+   message.msg_iov = &payload;
+   message.msg_iovlen = 1;
+   message.msg_control = control;
+   message.msg_controllen = sizeof(control);
+   if (recvmsg(fd, &message, MSG_CMSG_CLOEXEC) != ssize_t(sizeof(hello))) return;
+
+   int region = -1;
+   cmsghdr* attached = CMSG_FIRSTHDR(&message);
+   if (attached && attached->cmsg_level == SOL_SOCKET && attached->cmsg_type == SCM_RIGHTS) {
+      std::memcpy(&region, CMSG_DATA(attached), sizeof(int));
+   }
+
+   DaemonResponse accepted{~0u, DaemonStatus::InvalidRequest, 0, 0};
+   struct stat info;
+   if (region >= 0 && hello.magic == DaemonMagic && hello.numSlots > 0 && hello.slotSize >= 64 &&
+       fstat(region, &info) == 0 && uint64_t(info.st_size) >= hello.numSlots * hello.slotSize) {
+      void* mapped = mmap(nullptr, hello.numSlots * hello.slotSize, PROT_READ | PROT_WRITE, MAP_SHARED, region, 0);
+      if (mapped != MAP_FAILED) {
+         connection->base = static_cast<unsigned char*>(mapped);
+         connection->numSlots = hello.numSlots;
+         connection->slotSize = hello.slotSize;
+         accepted.status = DaemonStatus::Ok;
+      }
+   }
+   if (region >= 0) close(region);
+   connection->reply(accepted);
+   if (accepted.status != DaemonStatus::Ok) return;
+
+   // requests until the client disconnects (its pending jobs keep the connection alive)
+   DaemonRequest request;
+   while (daemonTransfer(fd, &request, sizeof(request), false)) {
+      if (request.slot >= connection->numSlots || request.inputSize > connection->slotSize) {
+         connection->reply({request.slot < connection->numSlots ? request.slot : 0, DaemonStatus::InvalidRequest, 0, 0});
+         continue;
+      }
+      queue.push({connection, request});
+   }
+   // abandon its jobs
+   connection->closed = true;
+}
+
+// ==================== SOCKET ====================
+
+/// the socket this daemon bound (removed on SIGINT / SIGTERM, but only if it's still the same file)
+static char boundPath[sizeof(sockaddr_un::sun_path)];
+static dev_t boundDevice;
+static ino_t boundInode;
+
+static void removeSocket(int)
+{
+   struct stat info;
+   if (lstat(boundPath, &info) == 0 && info.st_dev == boundDevice && info.st_ino == boundInode) unlink(boundPath);
+   _exit(0);
+}
+
+/// create the default socket's directory, it must be private
+static void prepareDirectory(const std::string& directory)
+{
+   if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST) daemonError("cannot create socket directory");
+   struct stat info;
+   if (lstat(directory.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) || info.st_uid != geteuid() ||
+       (info.st_mode & 0077) != 0)
+      daemonError("socket directory must be a private directory of the current user");
+}
+
+/// remove a leftover socket of an earlier daemon, but nothing else (another file, a running daemon, other users)
+static void removeStaleSocket(const sockaddr_un& address)
+{
+   struct stat info;
+   if (lstat(address.sun_path, &info) != 0) {
+      if (errno == ENOENT) return;
+      daemonError("cannot access socket path");
+   }
+   if (!S_ISSOCK(info.st_mode) || info.st_uid != geteuid()) daemonError("socket path is in use by another file");
+
+   // still accepting connections ?
+   const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (probe < 0) daemonError("cannot create socket");
+   const bool isAlive = connect(probe, (const sockaddr*)&address, sizeof(address)) == 0 || errno != ECONNREFUSED;
+   close(probe);
+   if (isAlive) daemonError("another smallz4d is already listening on that socket");
+   unlink(address.sun_path);
+}
+
+int main(int argc, const char* argv[])
+{
+   const std::string defaultSocket = daemonDefaultSocket();
+   const char* socketPath = nullptr;
+   unsigned numWorkers = 0; // one per hardware thread
+
+   for (int parameter = 1; parameter < argc; parameter++) {
+      const char* current = argv[parameter];
+      if (current[0] == '-' && current[1] == 's' && current[2] == '\0' && parameter + 1 < argc) {
+         socketPath = argv[++parameter];
+         continue;
+      }
+      if (current[0] == '-' && current[1] == 'j') {
+         const char* number = current[2] ? current + 2 : (parameter + 1 < argc ? argv[++parameter] : "");
+         numWorkers = unsigned(atoi(number));
+         if (numWorkers == 0) daemonError("invalid number of workers");
+         continue;
+      }
+      daemonError("usage: smallz4d [-s socket] [-j workers]");
+   }
+   if (numWorkers == 0) {
+      numWorkers = (std::max)(1u, std::thread::hardware_concurrency());
+   }
+
+   if (!socketPath) {
+      socketPath = defaultSocket.c_str();
+      prepareDirectory(defaultSocket.substr(0, defaultSocket.rfind('/')));
+   }
+
+   // only the owner may connect
+   sockaddr_un address{};
+   address.sun_family = AF_UNIX;
+   if (std::strlen(socketPath) >= sizeof(address.sun_path)) daemonError("socket path too long");
+   std::strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+   const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (listener < 0) daemonError("cannot create socket");
+   removeStaleSocket(address);
+   const mode_t previousMask = umask(0077);
+   const bool bound = bind(listener, (const sockaddr*)&address, sizeof(address)) == 0;
+   umask(previousMask);
+   if (!bound || listen(listener, 64) != 0) daemonError("cannot listen on socket");
+
+   // remember which file we created, remove it on shutdown
+   struct stat info;
+   if (lstat(socketPath, &info) != 0) daemonError("cannot access socket path");
+   std::memcpy(boundPath, address.sun_path, sizeof(boundPath));
+   boundDevice = info.st_dev;
+   boundInode = info.st_ino;
+   signal(SIGINT, removeSocket);
+   signal(SIGTERM, removeSocket);
+
+   // warm pool
+   JobQueue queue;
+   for (unsigned i = 0; i < numWorkers; i++) {
+      std::thread(worker, std::ref(queue)).detach();
+   }
+
+   while (true) {
+      const int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client < 0) continue;
+      std::thread(serveClient, client, std::ref(queue)).detach();
+   }
+}
@@ -1,10 +1,28 @@
 #include "smallz4.hpp"
 
+#include <cerrno> // ENXIO (sparse files)
 #include <cstdio> // stdin/stdout/stderr, fopen, ...
 #include <cstdlib> // exit
 #include <ctime> // time (verbose output)
-
+#include <mutex> // progress reports of parallel decoders
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // lseek with SEEK_HOLE / SEEK_DATA
+#endif
+
+#include "smallz4_batch.hpp"
+#include "smallz4_dictionary.hpp"
+#include "smallz4_metrics.hpp"
 #include "smallz4_original.hpp"
+#include "smallz4_pool.hpp"
+#include "smallz4_probes.hpp"
+#include "smallz4_recorder.hpp"
+#include "smallz4_trace.hpp"
+#include "smallz4_uring.hpp"
+#include "smallz4_verify.hpp"
 
 // This program is a shorter, more readable, albeit slower re-implementation of lz4cat (
 // https://github.com/Cyan4973/xxHash )
@@ -29,9 +47,274 @@ static void unlz4error(const char* msg)
 
 // ==================== LZ4 DECOMPRESSOR ====================
 
+// the decoder is specialized on each frame's features:
+// - decodeBlocks<HasBlockChecksum, HasDictionary> is instantiated for all combinations, unlz4blocks() picks one per
+//   frame (or restart group) after the frame header was parsed
+// - compressed and uncompressed blocks are handled by separate kernels, the block header decides which one runs
+// - so the block loop and the sequence loop don't test any frame flags
+// - a dictionary is loaded once per frame, not inside the block loop
+
+static constexpr size_t HISTORY_SIZE = 64 * 1024; // don't lower this value, backreferences can be 64kb far away
+
+/// optional cooperative cancellation and progress reports of the decoders (see smallz4::cancelled / progress)
+/** - checked before each block (restart groups and unlz4Batch: before each group / frame)
+    - unlz4() and unlz4InPlace() throw smallz4::Cancelled, unlz4Scan() and unlz4Batch() report "cancelled"
+    - progress is never called concurrently, even if several threads decode **/
+struct DecodeHooks
+{
+   /// set to true by another thread to abandon decoding
+   const std::atomic<bool>* cancelled = nullptr;
+   /// called with the number of compressed bytes processed so far and their total (unlz4Batch: frames)
+   std::function<void(uint64_t done, uint64_t total)> progress{};
+
+   bool isCancelled() const { return cancelled && cancelled->load(std::memory_order_relaxed); }
+
+   /// report progress and throw smallz4::Cancelled if asked to stop
+   void checkpoint(uint64_t done, uint64_t total) const
+   {
+      if (progress) progress(done, total);
+      if (isCancelled()) throw smallz4::Cancelled();
+   }
+};
+
+/// load the last 64k of a dictionary file
+static std::string unlz4dictionary(const char* filename)
+{
+   // open dictionary
+   FILE* dict = fopen(filename, "rb");
+   if (!dict) unlz4error("cannot open dictionary");
+
+   // get dictionary's filesize
+   fseek(dict, 0, SEEK_END);
+   int64_t dictSize = ftell(dict);
+   // only the last 64k are relevant
+   int64_t relevant = dictSize < 65536 ? 0 : dictSize - 65536;
+   fseek(dict, relevant, SEEK_SET);
+   if (dictSize > 65536) dictSize = 65536;
+   // read it
+   std::string content(size_t(dictSize), '\0');
+   content.resize(fread(content.data(), 1, content.size(), dict));
+   fclose(dict);
+   return content;
+}
+
+/// decode a compressed block of blockSize bytes into history[], full history is flushed to b
+static inline void decodeCompressedBlock(const unsigned char*& it, uint32_t blockSize, unsigned char* history,
+                                         uint32_t& position, std::string& b, size_t& ix)
+{
+   // local copies: writes to history[] could alias them otherwise
+   uint32_t pos = position;
+   const unsigned char* in = it;
+   uint32_t blockOffset = 0;
+   while (blockOffset < blockSize) {
+      // get a token
+      unsigned char token = *in;
+      ++in;
+      blockOffset++;
+
+      // determine number of literals
+      uint32_t numLiterals = token >> 4;
+      if (numLiterals == 15) {
+         // number of literals length encoded in more than 1 byte
+         unsigned char current;
+         do {
+            current = *in;
+            ++in;
+            numLiterals += current;
+            blockOffset++;
+         } while (current == 255);
+      }
+
+      blockOffset += numLiterals;
+
+      // copy all those literals
+      if (pos + numLiterals < HISTORY_SIZE) {
+         // fast loop
+         while (numLiterals-- > 0) {
+            history[pos++] = *in;
+            ++in;
+         }
+      }
+      else {
+         // slow loop
+         while (numLiterals-- > 0) {
+            history[pos++] = *in;
+            ++in;
+
+            // flush output buffer
+            if (pos == HISTORY_SIZE) {
+               smallz4::dump({history, HISTORY_SIZE}, b, ix);
+               pos = 0;
+            }
+         }
+      }
+
+      // last token has only literals
+      if (blockOffset == blockSize) break;
+
+      // match distance is encoded in two bytes (little endian)
+      uint32_t delta = *in;
+      ++in;
+      delta |= (uint32_t)(*in) << 8;
+      ++in;
+      // zero isn't allowed
+      if (delta == 0) unlz4error("invalid offset");
+      blockOffset += 2;
+
+      // match length (always >= 4, therefore length is stored minus 4)
+      uint32_t matchLength = 4 + (token & 0x0F);
+      if (matchLength == 4 + 0x0F) {
+         unsigned char current;
+         do // match length encoded in more than 1 byte
+         {
+            current = *in;
+            ++in;
+            matchLength += current;
+            blockOffset++;
+         } while (current == 255);
+      }
+
+      // copy match
+      uint32_t referencePos = (pos >= delta) ? (pos - delta) : (HISTORY_SIZE + pos - delta);
+      // start and end within the current 64k block ?
+      if (pos + matchLength < HISTORY_SIZE && referencePos + matchLength < HISTORY_SIZE) {
+         // read/write continuous block (no wrap-around at the end of history[])
+         // fast copy
+         if (pos >= referencePos + matchLength || referencePos >= pos + matchLength) {
+            // non-overlapping
+            memcpy(history + pos, history + referencePos, matchLength);
+            pos += matchLength;
+         }
+         else {
+            // overlapping, slower byte-wise copy
+            while (matchLength-- > 0) history[pos++] = history[referencePos++];
+         }
+      }
+      else {
+         // either read or write wraps around at the end of history[]
+         while (matchLength-- > 0) {
+            // copy single byte
+            history[pos++] = history[referencePos++];
+
+            // cannot write anymore ? => wrap around
+            if (pos == HISTORY_SIZE) {
+               // flush output buffer
+               smallz4::dump({history, HISTORY_SIZE}, b, ix);
+               pos = 0;
+            }
+            // wrap-around of read location
+            referencePos %= HISTORY_SIZE;
+         }
+      }
+   }
+
+   position = pos;
+   it = in;
+}
+
+/// copy an uncompressed block into history[] (if next block is compressed and some matches refer to this block)
+static inline void copyUncompressedBlock(const unsigned char*& it, uint32_t blockSize, unsigned char* history,
+                                         uint32_t& pos, std::string& b, size_t& ix)
+{
+   while (blockSize > 0) {
+      // copy as much as fits into history[] ...
+      const uint32_t numBytes = (std::min)(blockSize, uint32_t(HISTORY_SIZE - pos));
+      memcpy(history + pos, it, numBytes);
+      pos += numBytes;
+      it += numBytes;
+      blockSize -= numBytes;
+      // ... until buffer is full => send to output
+      if (pos == HISTORY_SIZE) {
+         smallz4::dump({history, HISTORY_SIZE}, b, ix);
+         pos = 0;
+      }
+   }
+}
+
+/// decode blocks until the end marker is found or stop is reached (unless nullptr), specialized on frame features
+/** - blockIndex of the first block is only needed for tracing and probes
+    - hooks see it - begin as done and total as total **/
+template <bool HasBlockChecksum, bool HasDictionary>
+static void decodeBlocks(const unsigned char*& it, const unsigned char* stop, std::string& b, size_t& ix,
+                         [[maybe_unused]] std::span<const unsigned char> dictionary,
+                         [[maybe_unused]] int64_t blockIndex, const DecodeHooks& hooks, const unsigned char* begin,
+                         uint64_t total)
+{
+   unsigned char history[HISTORY_SIZE]; // contains the latest decoded data
+   uint32_t pos = 0; // next free position in history[]
+
+   // dictionary compression is a recently introduced feature, just move its contents to the end of the buffer
+   if constexpr (HasDictionary) {
+      memcpy(history + HISTORY_SIZE - dictionary.size(), dictionary.data(), dictionary.size());
+   }
+
+   // parse all blocks until blockSize == 0
+   for (--blockIndex; it != stop;) {
+      ++blockIndex;
+      hooks.checkpoint(uint64_t(it - begin), total);
+      SMALLZ4_TRACE_SCOPE("decode block", "block", blockIndex);
+      uint32_t blockSize = *it;
+      ++it;
+      blockSize |= uint32_t(*it) << 8;
+      ++it;
+      blockSize |= uint32_t(*it) << 16;
+      ++it;
+      blockSize |= uint32_t(*it) << 24;
+      ++it;
+
+      // highest bit set ?
+      unsigned char isCompressed = (blockSize & 0x80000000) == 0;
+      blockSize &= 0x7FFFFFFF;
+
+      // stop after last block
+      if (blockSize == 0) break;
+
+      SMALLZ4_PROBE3(decode__block__start, blockIndex, blockSize, isCompressed);
+
+      if (isCompressed) {
+         decodeCompressedBlock(it, blockSize, history, pos, b, ix);
+      }
+      else {
+         copyUncompressedBlock(it, blockSize, history, pos, b, ix);
+      }
+
+      SMALLZ4_PROBE3(decode__block__end, blockIndex, blockSize, isCompressed);
+
+      if constexpr (HasBlockChecksum) {
+         it += 4; // ignore checksum, skip 4 bytes
+      }
+   }
+
+   smallz4::dump({history, pos}, b, ix);
+}
+
+/// decode blocks until the end marker is found or stop is reached (unless nullptr), history starts empty
+/** picks the decoder which matches the frame's features, dictionary holds at most the last 64k of a dictionary **/
+static void unlz4blocks(const unsigned char*& it, const unsigned char* stop, bool hasBlockChecksum, std::string& b,
+                        size_t& ix, std::span<const unsigned char> dictionary, int64_t blockIndex,
+                        const DecodeHooks& hooks = {}, const unsigned char* begin = nullptr, uint64_t total = 0)
+{
+   using Decoder = void (*)(const unsigned char*&, const unsigned char*, std::string&, size_t&,
+                            std::span<const unsigned char>, int64_t, const DecodeHooks&, const unsigned char*,
+                            uint64_t);
+   static constexpr Decoder Decoders[2][2] = {{decodeBlocks<false, false>, decodeBlocks<false, true>},
+                                               {decodeBlocks<true, false>, decodeBlocks<true, true>}};
+   Decoders[hasBlockChecksum][!dictionary.empty()](it, stop, b, ix, dictionary, blockIndex, hooks,
+                                                   begin ? begin : it, total);
+}
+
 /// decompress everything in input stream (accessed via getByte) and write to output stream (via sendBytes)
-void unlz4(const unsigned char*& it, const unsigned char* end, std::string& b, size_t& ix, const char* dictionary)
+/** restart groups (see smallz4::restartInterval) are decoded in parallel if a restart index follows the frame **/
+void unlz4(const unsigned char*& it, const unsigned char* end, std::string& b, size_t& ix, const char* dictionary,
+           const DecodeHooks& hooks = {})
 {
+   SMALLZ4_METRICS_ONLY(const unsigned char* const frameBegin = it; const size_t outputBegin = ix;
+                        auto count = [&]() {
+                           smallz4_metrics::add(smallz4_metrics::DecodeFrames, 1);
+                           smallz4_metrics::add(smallz4_metrics::DecodeInputBytes, uint64_t(it - frameBegin));
+                           smallz4_metrics::add(smallz4_metrics::DecodeOutputBytes, ix - outputBegin);
+                        };)
+
    // signature
    unsigned char signature1 = *it;
    ++it;
@@ -77,186 +360,836 @@ void unlz4(const unsigned char*& it, const unsigned char* end, std::string& b, s
 
    it += numIgnore; // skip all those ignored bytes
 
-   static constexpr size_t HISTORY_SIZE = 64 * 1024; // don't lower this value, backreferences can be 64kb far away
-   unsigned char history[HISTORY_SIZE]; // contains the latest decoded data
-   uint32_t pos = 0; // next free position in history[]
+   // read dictionary only once, no matter how many restart groups there are
+   const std::string dictionaryContent = dictionary ? unlz4dictionary(dictionary) : std::string();
+   const std::span<const unsigned char> dictionaryBytes(
+      reinterpret_cast<const unsigned char*>(dictionaryContent.data()), dictionaryContent.size());
 
-   // dictionary compression is a recently introduced feature, just move its contents to the buffer
-   if (dictionary) {
-      // open dictionary
-      FILE* dict = fopen(dictionary, "rb");
-      if (!dict) unlz4error("cannot open dictionary");
+   // several independent groups of blocks ?
+   const unsigned char* frame = it - (4 + 1 + numIgnore);
+   std::vector<smallz4::RestartPoint> restartPoints;
+   uint64_t decompressedSize = 0;
+   if (!smallz4::readRestartIndex(frame, end, restartPoints, decompressedSize) || restartPoints.size() < 2) {
+      unlz4blocks(it, nullptr, hasBlockChecksum, b, ix, dictionaryBytes, 0, hooks, frame, uint64_t(end - frame));
 
-      // get dictionary's filesize
-      fseek(dict, 0, SEEK_END);
-      int64_t dictSize = ftell(dict);
-      // only the last 64k are relevant
-      int64_t relevant = dictSize < 65536 ? 0 : dictSize - 65536;
-      fseek(dict, relevant, SEEK_SET);
-      if (dictSize > 65536) dictSize = 65536;
-      // read it and store it at the end of the buffer
-      fread(history + HISTORY_SIZE - dictSize, 1, dictSize, dict);
-      fclose(dict);
+      if (hasContentChecksum) {
+         it += 4; // ignore checksum, skip 4 bytes
+      }
+      if (hooks.progress) hooks.progress(uint64_t(it - frame), uint64_t(end - frame));
+      SMALLZ4_METRICS_ONLY(count();)
+      return;
    }
 
-   // parse all blocks until blockSize == 0
-   while (true) {
-      uint32_t blockSize = *it;
-      ++it;
-      blockSize |= uint32_t(*it) << 8;
-      ++it;
-      blockSize |= uint32_t(*it) << 16;
-      ++it;
-      blockSize |= uint32_t(*it) << 24;
-      ++it;
+   // decode each group into a worker's scratch buffer, then copy to its final location
+   // (writing straight into b could resize it while other workers are writing, too, if input is corrupted)
+   const size_t numGroups = restartPoints.size();
+   std::vector<std::string> scratch(parallelWorkers(numGroups, 0));
+   if (b.size() < ix + decompressedSize) {
+      b.resize(ix + decompressedSize);
+   }
+   // workers must not throw: a cancelled run skips all remaining groups and throws afterwards
+   std::atomic<bool> skipped{false};
+   std::mutex progressLock;
+   uint64_t progressDone = 0;
+   parallelFor(numGroups, unsigned(scratch.size()), [&](unsigned worker, size_t group) {
+      if (hooks.isCancelled()) {
+         skipped = true;
+         return;
+      }
+      const smallz4::RestartPoint& current = restartPoints[group];
+      const bool isLast = (group + 1 == numGroups);
+      const uint64_t groupSize = (isLast ? decompressedSize : restartPoints[group + 1].decompressedOffset) -
+                                 current.decompressedOffset;
+
+      const unsigned char* groupIt = frame + current.compressedOffset;
+      const unsigned char* groupStop = isLast ? nullptr : frame + restartPoints[group + 1].compressedOffset;
+      size_t groupIx = 0;
+      const auto groupDictionary = group == 0 ? dictionaryBytes : std::span<const unsigned char>();
+      unlz4blocks(groupIt, groupStop, hasBlockChecksum, scratch[worker], groupIx, groupDictionary,
+                  int64_t(current.decompressedOffset / (4 * 1024 * 1024)));
+      if (groupIx != groupSize) unlz4error("restart index doesn't match frame");
+
+      std::memcpy(b.data() + ix + current.decompressedOffset, scratch[worker].data(), groupIx);
+
+      if (hooks.progress) {
+         std::lock_guard<std::mutex> lock(progressLock);
+         progressDone += uint64_t(groupIt - (frame + current.compressedOffset));
+         hooks.progress(progressDone, uint64_t(end - frame));
+      }
+   });
+   if (skipped) throw smallz4::Cancelled();
+   ix += decompressedSize;
+
+   // skip everything up to the end of the restart index
+   it = end;
+   if (hooks.progress) hooks.progress(uint64_t(end - frame), uint64_t(end - frame));
+   SMALLZ4_METRICS_ONLY(count();)
+}
 
-      // highest bit set ?
-      unsigned char isCompressed = (blockSize & 0x80000000) == 0;
+// ==================== IN-PLACE DECOMPRESSION ====================
+
+// a frame can be decoded into the very buffer which holds it:
+// - the compressed bytes are stored at the end of the buffer, the decompressed bytes grow from its beginning
+// - each write must stay in front of the next unread compressed byte
+// - so the buffer needs the decompressed size plus a margin, which depends on the frame (see unlz4InPlaceMargin)
+// - smallz4::inPlaceBlockMargin bounds that margin for frames produced by the compressor
+// - dictionaries aren't supported
+
+/// skip a frame header, return pointer to the first block
+static const unsigned char* skipFrameHeader(const unsigned char* it, const unsigned char* end, bool& hasBlockChecksum,
+                                            bool& hasContentChecksum)
+{
+   if (end - it < 7) unlz4error("out of data");
+   uint32_t signature;
+   std::memcpy(&signature, it, 4);
+   if (signature != 0x184D2204) unlz4error("invalid signature");
+
+   const unsigned char flags = it[4];
+   if ((flags >> 6) != 1) unlz4error("only LZ4 file format version 1 supported");
+   hasBlockChecksum = (flags & 16) != 0;
+   hasContentChecksum = (flags & 4) != 0;
+
+   // magic, flags, block size, optional content size and dictionary ID, header checksum
+   const size_t headerSize = 4 + 1 + 1 + ((flags & 8) ? 8 : 0) + ((flags & 1) ? 4 : 0) + 1;
+   if (size_t(end - it) < headerSize) unlz4error("out of data");
+   return it + headerSize;
+}
+
+/// count a failed in-place decoding, then abort like unlz4error()
+static void unlz4decodeError(const char* msg)
+{
+   SMALLZ4_METRICS_ONLY(smallz4_metrics::add(smallz4_metrics::DecodeErrors, 1);)
+   unlz4error(msg);
+}
+
+/// walk through a frame without decoding it, return how many bytes unlz4InPlace() needs beyond the decompressed size
+/** [begin, end) are all compressed bytes which will be stored at the end of the buffer (trailing bytes after the frame
+    are allowed, e.g. a restart index) **/
+uint64_t unlz4InPlaceMargin(const unsigned char* begin, const unsigned char* end, uint64_t& decompressedSize)
+{
+   bool hasBlockChecksum, hasContentChecksum;
+   const unsigned char* it = skipFrameHeader(begin, end, hasBlockChecksum, hasContentChecksum);
+
+   // decompressed bytes minus consumed compressed bytes must never exceed the gap between both streams
+   int64_t written = 0;
+   int64_t maxDiff = 0;
+   auto update = [&]() { maxDiff = (std::max)(maxDiff, written - int64_t(it - begin)); };
+   auto needs = [&](size_t numBytes) {
+      if (size_t(end - it) < numBytes) unlz4decodeError("out of data");
+   };
+
+   while (true) {
+      needs(4);
+      uint32_t blockSize;
+      std::memcpy(&blockSize, it, 4);
+      it += 4;
+      const bool isCompressed = (blockSize & 0x80000000) == 0;
       blockSize &= 0x7FFFFFFF;
+      if (blockSize == 0) break;
 
-      // stop after last block
+      needs(blockSize + (hasBlockChecksum ? 4 : 0));
+      const unsigned char* const blockEnd = it + blockSize;
+      if (!isCompressed) {
+         it += blockSize;
+         written += blockSize;
+         update();
+      }
+      while (it < blockEnd && isCompressed) {
+         const unsigned char token = *it++;
+
+         uint64_t numLiterals = token >> 4;
+         if (numLiterals == 15) {
+            unsigned char current;
+            do {
+               if (it == blockEnd) unlz4decodeError("invalid block");
+               current = *it++;
+               numLiterals += current;
+            } while (current == 255);
+         }
+         if (uint64_t(blockEnd - it) < numLiterals) unlz4decodeError("invalid block");
+         it += numLiterals;
+         written += int64_t(numLiterals);
+         update();
+
+         // last token has only literals
+         if (it == blockEnd) break;
+
+         if (blockEnd - it < 2) unlz4decodeError("invalid block");
+         const uint32_t delta = it[0] | (uint32_t(it[1]) << 8);
+         it += 2;
+         if (delta == 0 || delta > written) unlz4decodeError("invalid offset");
+
+         uint64_t matchLength = 4 + (token & 0x0F);
+         if (matchLength == 4 + 15) {
+            unsigned char current;
+            do {
+               if (it == blockEnd) unlz4decodeError("invalid block");
+               current = *it++;
+               matchLength += current;
+            } while (current == 255);
+         }
+         written += int64_t(matchLength);
+         update();
+      }
+
+      if (hasBlockChecksum) it += 4; // ignore checksum
+   }
+   if (hasContentChecksum) it += 4; // ignore checksum
+
+   decompressedSize = uint64_t(written);
+   // buffer size = compressed size + maxDiff, but at least the decompressed size
+   const uint64_t required = uint64_t(end - begin) + uint64_t(maxDiff);
+   return required > decompressedSize ? required - decompressedSize : 0;
+}
+
+/// decompress the frame stored in buffer[bufferSize - compressedSize, bufferSize) into buffer[0, ...)
+/** returns the decompressed size, bufferSize must be at least decompressed size + unlz4InPlaceMargin()
+    (if cancelled, the buffer holds neither the compressed nor the decompressed data anymore) **/
+size_t unlz4InPlace(unsigned char* buffer, size_t bufferSize, size_t compressedSize, const DecodeHooks& hooks = {})
+{
+   if (compressedSize > bufferSize) unlz4decodeError("out of data");
+   const unsigned char* const begin = buffer + bufferSize - compressedSize;
+
+   // validates the whole frame, too
+   uint64_t decompressedSize;
+   const uint64_t margin = unlz4InPlaceMargin(begin, buffer + bufferSize, decompressedSize);
+   if (bufferSize < decompressedSize + margin) unlz4decodeError("buffer too small for in-place decompression");
+
+   bool hasBlockChecksum, hasContentChecksum;
+   const unsigned char* it = skipFrameHeader(begin, buffer + bufferSize, hasBlockChecksum, hasContentChecksum);
+   unsigned char* out = buffer;
+   while (true) {
+      try {
+         hooks.checkpoint(uint64_t(it - begin), compressedSize);
+      }
+      catch (const smallz4::Cancelled&) {
+         SMALLZ4_METRICS_ONLY(smallz4_metrics::add(smallz4_metrics::DecodeErrors, 1);)
+         throw;
+      }
+      uint32_t blockSize;
+      std::memcpy(&blockSize, it, 4);
+      it += 4;
+      const bool isCompressed = (blockSize & 0x80000000) == 0;
+      blockSize &= 0x7FFFFFFF;
       if (blockSize == 0) break;
 
-      if (isCompressed) {
-         // decompress block
-         uint32_t blockOffset = 0;
-         uint32_t numWritten = 0;
-         while (blockOffset < blockSize) {
-            // get a token
-            unsigned char token = *it;
-            ++it;
-            blockOffset++;
+      const unsigned char* const blockEnd = it + blockSize;
+      if (!isCompressed) {
+         // source and destination may overlap
+         std::memmove(out, it, blockSize);
+         out += blockSize;
+         it += blockSize;
+      }
+      while (it < blockEnd && isCompressed) {
+         const unsigned char token = *it++;
+
+         size_t numLiterals = token >> 4;
+         if (numLiterals == 15) {
+            unsigned char current;
+            do {
+               current = *it++;
+               numLiterals += current;
+            } while (current == 255);
+         }
+         std::memmove(out, it, numLiterals);
+         out += numLiterals;
+         it += numLiterals;
+
+         // last token has only literals
+         if (it == blockEnd) break;
+
+         const uint32_t delta = it[0] | (uint32_t(it[1]) << 8);
+         it += 2;
+
+         size_t matchLength = 4 + (token & 0x0F);
+         if (matchLength == 4 + 15) {
+            unsigned char current;
+            do {
+               current = *it++;
+               matchLength += current;
+            } while (current == 255);
+         }
+
+         // the margin guarantees that the match doesn't overwrite unread input
+         const unsigned char* reference = out - delta;
+         if (delta >= matchLength) {
+            std::memcpy(out, reference, matchLength);
+            out += matchLength;
+         }
+         else {
+            // overlapping, slower byte-wise copy
+            while (matchLength-- > 0) *out++ = *reference++;
+         }
+      }
+
+      if (hasBlockChecksum) it += 4; // ignore checksum
+   }
+   if (hooks.progress) hooks.progress(compressedSize, compressedSize);
+
+   SMALLZ4_METRICS_ONLY({
+      smallz4_metrics::add(smallz4_metrics::DecodeFrames, 1);
+      smallz4_metrics::add(smallz4_metrics::DecodeInputBytes, compressedSize);
+      smallz4_metrics::add(smallz4_metrics::DecodeOutputBytes, uint64_t(out - buffer));
+   })
+   return size_t(out - buffer);
+}
+
+// ==================== STRUCTURAL SCAN ====================
+
+// validate LZ4 data and determine its decompressed size without producing any output:
+// - only block headers and tokens are parsed, literals are skipped and match lengths are just added up
+// - each match's offset is checked against the number of bytes its frame produced so far
+// - header and block checksums are verified because they cover the compressed bytes, while content checksums
+//   would need the decompressed bytes (they are skipped)
+// - several frames (see smallz4::maxFrameSize) and skippable frames (e.g. a restart index) may follow each other
+
+/// xxHash32, see https://create.stephan-brumme.com/xxhash/
+static uint32_t xxhash32(const unsigned char* data, size_t numBytes, uint32_t seed = 0)
+{
+   constexpr uint32_t Prime1 = 2654435761U;
+   constexpr uint32_t Prime2 = 2246822519U;
+   constexpr uint32_t Prime3 = 3266489917U;
+   constexpr uint32_t Prime4 = 668265263U;
+   constexpr uint32_t Prime5 = 374761393U;
+   auto rotateLeft = [](uint32_t x, int bits) { return (x << bits) | (x >> (32 - bits)); };
+   auto read32 = [](const unsigned char* at) {
+      uint32_t value;
+      std::memcpy(&value, at, 4);
+      return value;
+   };
+
+   const unsigned char* it = data;
+   const unsigned char* const stop = data + numBytes;
+   uint32_t hash;
+   if (numBytes >= 16) {
+      // four interleaved states
+      uint32_t state1 = seed + Prime1 + Prime2;
+      uint32_t state2 = seed + Prime2;
+      uint32_t state3 = seed;
+      uint32_t state4 = seed - Prime1;
+      do {
+         state1 = rotateLeft(state1 + read32(it) * Prime2, 13) * Prime1;
+         state2 = rotateLeft(state2 + read32(it + 4) * Prime2, 13) * Prime1;
+         state3 = rotateLeft(state3 + read32(it + 8) * Prime2, 13) * Prime1;
+         state4 = rotateLeft(state4 + read32(it + 12) * Prime2, 13) * Prime1;
+         it += 16;
+      } while (stop - it >= 16);
+      hash = rotateLeft(state1, 1) + rotateLeft(state2, 7) + rotateLeft(state3, 12) + rotateLeft(state4, 18);
+   }
+   else {
+      hash = seed + Prime5;
+   }
+   hash += uint32_t(numBytes);
+
+   // remaining 0 ... 15 bytes
+   for (; stop - it >= 4; it += 4) hash = rotateLeft(hash + read32(it) * Prime3, 17) * Prime4;
+   for (; it != stop; ++it) hash = rotateLeft(hash + *it * Prime5, 11) * Prime1;
+
+   // final avalanche
+   hash ^= hash >> 15;
+   hash *= Prime2;
+   hash ^= hash >> 13;
+   hash *= Prime3;
+   hash ^= hash >> 16;
+   return hash;
+}
+
+/// what unlz4Scan() found
+struct ScanResult
+{
+   uint64_t decompressedSize = 0; // all frames
+   uint64_t numFrames = 0; // without skippable frames
+   uint64_t numBlocks = 0;
+   uint64_t numChecksums = 0; // verified header and block checksums
+};
+
+/// see unlz4Scan()
+static const char* unlz4ScanFrames(const unsigned char* begin, const unsigned char* end, ScanResult& result,
+                                   uint64_t dictionarySize, const DecodeHooks& hooks)
+{
+   result = {};
+   const unsigned char* it = begin;
+   while (it != end) {
+      if (end - it < 8) return "out of data";
+      uint32_t signature;
+      std::memcpy(&signature, it, 4);
+
+      // skippable frame: magic, size, payload
+      if ((signature & 0xFFFFFFF0) == 0x184D2A50) {
+         uint32_t size;
+         std::memcpy(&size, it + 4, 4);
+         if (uint64_t(end - it) - 8 < size) return "truncated skippable frame";
+         it += 8 + size;
+         continue;
+      }
+      if (signature != 0x184D2204) return "invalid signature";
+
+      // frame descriptor: flags, block size, optional content size and dictionary ID, header checksum
+      const unsigned char flags = it[4];
+      const unsigned char blockMaximum = it[5];
+      if ((flags >> 6) != 1) return "only LZ4 file format version 1 supported";
+      if ((flags & 2) != 0 || (blockMaximum & 0x8F) != 0) return "reserved bits are set";
+      const unsigned blockSizeId = blockMaximum >> 4;
+      if (blockSizeId < 4) return "invalid maximum block size";
+      const uint32_t maxBlockSize = uint32_t(1) << (8 + 2 * blockSizeId);
+      const bool hasBlockChecksum = (flags & 16) != 0;
+      const bool hasContentSize = (flags & 8) != 0;
+      const bool hasContentChecksum = (flags & 4) != 0;
+
+      const size_t descriptorSize = 2 + (hasContentSize ? 8 : 0) + ((flags & 1) ? 4 : 0);
+      if (size_t(end - it) < 4 + descriptorSize + 1) return "out of data";
+      if (((xxhash32(it + 4, descriptorSize) >> 8) & 0xFF) != it[4 + descriptorSize]) return "header checksum mismatch";
+      ++result.numChecksums;
+      uint64_t contentSize = 0;
+      if (hasContentSize) std::memcpy(&contentSize, it + 6, 8);
+      it += 4 + descriptorSize + 1;
+
+      // decompressed bytes of the current frame
+      uint64_t written = 0;
+      while (true) {
+         if (hooks.progress) hooks.progress(uint64_t(it - begin), uint64_t(end - begin));
+         if (hooks.isCancelled()) return "cancelled";
+         if (end - it < 4) return "out of data";
+         uint32_t blockSize;
+         std::memcpy(&blockSize, it, 4);
+         it += 4;
+         const bool isCompressed = (blockSize & 0x80000000) == 0;
+         blockSize &= 0x7FFFFFFF;
+         if (blockSize == 0) break;
+
+         if (blockSize > maxBlockSize) return "block exceeds maximum block size";
+         if (size_t(end - it) < size_t(blockSize) + (hasBlockChecksum ? 4 : 0)) return "out of data";
+         const unsigned char* const blockEnd = it + blockSize;
+         if (hasBlockChecksum) {
+            uint32_t checksum;
+            std::memcpy(&checksum, blockEnd, 4);
+            if (xxhash32(it, blockSize) != checksum) return "block checksum mismatch";
+            ++result.numChecksums;
+         }
 
-            // determine number of literals
-            uint32_t numLiterals = token >> 4;
+         if (!isCompressed) {
+            written += blockSize;
+            it = blockEnd;
+         }
+         const uint64_t blockBegin = written;
+         while (it != blockEnd && isCompressed) {
+            const unsigned char token = *it++;
+
+            uint64_t numLiterals = token >> 4;
             if (numLiterals == 15) {
-               // number of literals length encoded in more than 1 byte
                unsigned char current;
                do {
-                  current = *it;
-                  ++it;
+                  if (it == blockEnd) return "truncated literal length";
+                  current = *it++;
                   numLiterals += current;
-                  blockOffset++;
                } while (current == 255);
             }
+            if (uint64_t(blockEnd - it) < numLiterals) return "literals beyond end of block";
+            it += numLiterals;
+            written += numLiterals;
 
-            blockOffset += numLiterals;
+            // last token has only literals
+            if (it == blockEnd) break;
 
-            // copy all those literals
-            if (pos + numLiterals < HISTORY_SIZE) {
-               // fast loop
-               while (numLiterals-- > 0) {
-                  history[pos++] = *it;
-                  ++it;
-               }
-            }
-            else {
-               // slow loop
-               while (numLiterals-- > 0) {
-                  history[pos++] = *it;
-                  ++it;
-
-                  // flush output buffer
-                  if (pos == HISTORY_SIZE) {
-                     smallz4::dump({history, HISTORY_SIZE}, b, ix);
-                     numWritten += HISTORY_SIZE;
-                     pos = 0;
-                  }
-               }
-            }
+            if (blockEnd - it < 2) return "truncated offset";
+            const uint32_t delta = it[0] | (uint32_t(it[1]) << 8);
+            it += 2;
+            if (delta == 0 || delta > written + dictionarySize) return "invalid offset";
 
-            // last token has only literals
-            if (blockOffset == blockSize) break;
-
-            // match distance is encoded in two bytes (little endian)
-            uint32_t delta = *it;
-            ++it;
-            delta |= (uint32_t)(*it) << 8;
-            ++it;
-            // zero isn't allowed
-            if (delta == 0) unlz4error("invalid offset");
-            blockOffset += 2;
-
-            // match length (always >= 4, therefore length is stored minus 4)
-            uint32_t matchLength = 4 + (token & 0x0F);
-            if (matchLength == 4 + 0x0F) {
+            uint64_t matchLength = 4 + (token & 0x0F);
+            if (matchLength == 4 + 15) {
                unsigned char current;
-               do // match length encoded in more than 1 byte
-               {
-                  current = *it;
-                  ++it;
+               do {
+                  if (it == blockEnd) return "truncated match length";
+                  current = *it++;
                   matchLength += current;
-                  blockOffset++;
                } while (current == 255);
             }
-
-            // copy match
-            uint32_t referencePos = (pos >= delta) ? (pos - delta) : (HISTORY_SIZE + pos - delta);
-            // start and end within the current 64k block ?
-            if (pos + matchLength < HISTORY_SIZE && referencePos + matchLength < HISTORY_SIZE) {
-               // read/write continuous block (no wrap-around at the end of history[])
-               // fast copy
-               if (pos >= referencePos + matchLength || referencePos >= pos + matchLength) {
-                  // non-overlapping
-                  memcpy(history + pos, history + referencePos, matchLength);
-                  pos += matchLength;
-               }
-               else {
-                  // overlapping, slower byte-wise copy
-                  while (matchLength-- > 0) history[pos++] = history[referencePos++];
-               }
-            }
-            else {
-               // either read or write wraps around at the end of history[]
-               while (matchLength-- > 0) {
-                  // copy single byte
-                  history[pos++] = history[referencePos++];
-
-                  // cannot write anymore ? => wrap around
-                  if (pos == HISTORY_SIZE) {
-                     // flush output buffer
-                     smallz4::dump({history, HISTORY_SIZE}, b, ix);
-                     numWritten += HISTORY_SIZE;
-                     pos = 0;
-                  }
-                  // wrap-around of read location
-                  referencePos %= HISTORY_SIZE;
-               }
-            }
+            written += matchLength;
+            if (it == blockEnd) return "block ends with a match";
          }
+         if (written - blockBegin > maxBlockSize) return "block exceeds maximum block size";
+
+         if (hasBlockChecksum) it += 4;
+         ++result.numBlocks;
+      }
+
+      // content checksum covers the decompressed bytes, can't be verified
+      if (hasContentChecksum) {
+         if (end - it < 4) return "out of data";
+         it += 4;
+      }
+      if (hasContentSize && contentSize != written) return "content size mismatch";
+
+      result.decompressedSize += written;
+      ++result.numFrames;
+   }
+
+   if (result.numFrames == 0) return "no LZ4 frame found";
+   if (hooks.progress) hooks.progress(uint64_t(end - begin), uint64_t(end - begin));
+   return nullptr;
+}
+
+/// walk through all frames in [begin, end) without decoding them, return nullptr if well-formed or else an error
+/** matches near the beginning of each frame may refer to dictionarySize bytes of a dictionary **/
+const char* unlz4Scan(const unsigned char* begin, const unsigned char* end, ScanResult& result,
+                      uint64_t dictionarySize = 0, const DecodeHooks& hooks = {})
+{
+   const char* error = unlz4ScanFrames(begin, end, result, dictionarySize, hooks);
+   SMALLZ4_METRICS_ONLY(if (error) smallz4_metrics::add(smallz4_metrics::DecodeErrors, 1);)
+   return error;
+}
+
+// ==================== TWO-PHASE DECODING ====================
+
+// a compressed block can be decoded in two passes:
+// - parseSequences() reads only tokens, lengths and offsets and stores each sequence in a compact array, validating
+//   the whole block in the process (bounds, offsets, output size)
+// - executeSequences() then copies literals and matches without any further checks; since all sequences are known
+//   in advance, it prefetches match sources a few sequences ahead, hiding cache misses of far offsets
+// - the sequence array is useful on its own, e.g. for statistics or validation tools
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SMALLZ4_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define SMALLZ4_PREFETCH(address)
+#endif
+
+/// literals followed by a match (the last sequence of a block may have no match)
+struct Sequence
+{
+   uint32_t literalsFrom; // relative to the block's first byte (behind its block header)
+   uint32_t numLiterals;
+   uint32_t offset; // 0 if no match
+   uint32_t matchLength; // 0 if no match
+};
+
+/// split a compressed block into its sequences, return nullptr if valid
+/** - parsing starts at block[position] and stops after maxSequences sequences or at the end of the block, position is
+      updated, so that the next call continues from there (keeps the sequence array small and hot in L1)
+    - history = number of decoded bytes in front of block[position] (matches may refer to them)
+    - capacity = maximum number of bytes these sequences may produce **/
+const char* parseSequences(std::span<const unsigned char> block, size_t& position, uint64_t history, uint64_t capacity,
+                           std::vector<Sequence>& sequences, size_t maxSequences = SIZE_MAX)
+{
+   sequences.clear();
+   capacity = (std::min)(capacity, uint64_t(0xFFFFFFFF)); // lengths must fit into 32 bits
+
+   const unsigned char* it = block.data() + position;
+   const unsigned char* const end = block.data() + block.size();
+   uint64_t written = 0;
+   while (it != end && sequences.size() < maxSequences) {
+      const unsigned char token = *it++;
+
+      uint64_t numLiterals = token >> 4;
+      if (numLiterals == 15) {
+         unsigned char current;
+         do {
+            if (it == end) return "truncated literal length";
+            current = *it++;
+            numLiterals += current;
+         } while (current == 255);
+      }
+      if (numLiterals > uint64_t(end - it)) return "literals beyond end of block";
+      if (numLiterals > capacity - written) return "output too small";
+      Sequence sequence{uint32_t(it - block.data()), uint32_t(numLiterals), 0, 0};
+      it += numLiterals;
+      written += numLiterals;
+
+      // last token has only literals
+      if (it == end) {
+         sequences.push_back(sequence);
+         break;
+      }
+
+      if (end - it < 2) return "truncated offset";
+      const uint32_t delta = it[0] | (uint32_t(it[1]) << 8);
+      it += 2;
+      if (delta == 0 || delta > history + written) return "invalid offset";
+
+      uint64_t matchLength = 4 + (token & 0x0F);
+      if (matchLength == 4 + 15) {
+         unsigned char current;
+         do {
+            if (it == end) return "truncated match length";
+            current = *it++;
+            matchLength += current;
+         } while (current == 255);
+      }
+      if (matchLength > capacity - written) return "output too small";
+      written += matchLength;
+
+      sequence.offset = delta;
+      sequence.matchLength = uint32_t(matchLength);
+      sequences.push_back(sequence);
+   }
+
+   position = size_t(it - block.data());
+   return nullptr;
+}
+
+/// copy the literals and matches parsed by parseSequences(), return pointer behind the last written byte
+/** out must be preceded by the sequences' history and have room for their decompressed size **/
+unsigned char* executeSequences(const unsigned char* block, std::span<const Sequence> sequences, unsigned char* out)
+{
+   // match sources are prefetched that many sequences in advance
+   constexpr size_t PrefetchDistance = 8;
+
+   // where the sequence PrefetchDistance ahead of the current one begins
+   unsigned char* ahead = out;
+   const size_t numAhead = (std::min)(PrefetchDistance, sequences.size());
+   for (size_t i = 0; i < numAhead; ++i) {
+      SMALLZ4_PREFETCH(ahead + sequences[i].numLiterals - sequences[i].offset);
+      ahead += sequences[i].numLiterals + sequences[i].matchLength;
+   }
+
+   for (size_t i = 0; i < sequences.size(); ++i) {
+      if (i + PrefetchDistance < sequences.size()) {
+         const Sequence& future = sequences[i + PrefetchDistance];
+         SMALLZ4_PREFETCH(ahead + future.numLiterals - future.offset);
+         ahead += future.numLiterals + future.matchLength;
+      }
+
+      const Sequence& current = sequences[i];
+      std::memcpy(out, block + current.literalsFrom, current.numLiterals);
+      out += current.numLiterals;
+
+      const unsigned char* from = out - current.offset;
+      if (current.offset >= current.matchLength) {
+         std::memcpy(out, from, current.matchLength);
+         out += current.matchLength;
       }
       else {
-         // copy uncompressed data and add to history, too (if next block is compressed and some matches refer to this
-         // block)
-         while (blockSize-- > 0) {
-            // copy a byte ...
-            history[pos++] = *it;
-            ++it;
-            // ... until buffer is full => send to output
-            if (pos == HISTORY_SIZE) {
-               smallz4::dump({history, HISTORY_SIZE}, b, ix);
-               pos = 0;
-            }
+         // overlapping, slower byte-wise copy
+         for (uint32_t matchLength = current.matchLength; matchLength > 0; --matchLength) *out++ = *from++;
+      }
+   }
+   return out;
+}
+
+// ==================== BATCH DECOMPRESSION ====================
+
+// decode many small frames (e.g. cached records) with as little per-frame overhead as possible:
+// - each frame is decoded straight into a caller-provided output span, which serves as its history, too (no 64k
+//   history array, no growing std::string)
+// - all frame headers are validated in a first pass (including header checksums and content sizes vs. output spans),
+//   so that the decoding pass only touches frames which are going to succeed, unless their blocks are corrupted
+// - blocks are bounds-checked, a corrupted frame never writes outside of its output span
+// - bytes behind a frame's end marker (e.g. a restart index) are ignored, block and content checksums are skipped
+// - dictionaries aren't supported
+// - numWorkers != 1 decodes ranges of frames in parallel
+// - twoPhase switches to parseSequences() + executeSequences(), which pays off if match sources often miss the cache
+
+/// outcome of one frame of unlz4Batch()
+struct BatchResult
+{
+   size_t decompressedSize = 0;
+   const char* error = nullptr; // nullptr if successful
+};
+
+/// size of a frame header with these flags: magic, flags, block size, content size, dictionary ID, header checksum
+static size_t batchHeaderSize(unsigned char flags)
+{
+   return 4 + 1 + 1 + ((flags & 8) ? 8 : 0) + ((flags & 1) ? 4 : 0) + 1;
+}
+
+/// check a frame header, return nullptr if valid
+static const char* checkBatchHeader(std::span<const unsigned char> frame, size_t outputSize)
+{
+   if (frame.size() < 7) return "out of data";
+   uint32_t signature;
+   std::memcpy(&signature, frame.data(), 4);
+   if (signature != 0x184D2204) return "invalid signature";
+
+   const unsigned char flags = frame[4];
+   if ((flags >> 6) != 1) return "only LZ4 file format version 1 supported";
+   if ((flags & 2) != 0 || (frame[5] & 0x8F) != 0) return "reserved bits are set";
+   if ((frame[5] >> 4) < 4) return "invalid maximum block size";
+   if ((flags & 1) != 0) return "dictionaries are not supported";
+
+   const size_t headerSize = batchHeaderSize(flags);
+   if (frame.size() < headerSize + 4) return "out of data"; // plus end marker
+   if (((xxhash32(frame.data() + 4, headerSize - 5) >> 8) & 0xFF) != frame[headerSize - 1])
+      return "header checksum mismatch";
+
+   if ((flags & 8) != 0) {
+      uint64_t contentSize;
+      std::memcpy(&contentSize, frame.data() + 6, 8);
+      if (contentSize > outputSize) return "output too small";
+   }
+   return nullptr;
+}
+
+/// decode a frame whose header was already checked, return nullptr if successful
+/** twoPhase: decode compressed blocks with parseSequences() and executeSequences() (sequences is scratch space) **/
+static const char* decodeBatchFrame(std::span<const unsigned char> frame, std::span<unsigned char> output,
+                                    bool twoPhase, std::vector<Sequence>& sequences, size_t& decompressedSize)
+{
+   const unsigned char flags = frame[4];
+   const bool hasBlockChecksum = (flags & 16) != 0;
+   const uint32_t maxBlockSize = uint32_t(1) << (8 + 2 * (frame[5] >> 4));
+
+   const unsigned char* it = frame.data() + batchHeaderSize(flags);
+   const unsigned char* const end = frame.data() + frame.size();
+   unsigned char* const outBegin = output.data();
+   unsigned char* const outEnd = outBegin + output.size();
+   unsigned char* out = outBegin;
+
+   while (true) {
+      if (end - it < 4) return "out of data";
+      uint32_t blockSize;
+      std::memcpy(&blockSize, it, 4);
+      it += 4;
+      const bool isCompressed = (blockSize & 0x80000000) == 0;
+      blockSize &= 0x7FFFFFFF;
+      if (blockSize == 0) break;
+
+      if (blockSize > maxBlockSize) return "block exceeds maximum block size";
+      if (size_t(end - it) < size_t(blockSize) + (hasBlockChecksum ? 4 : 0)) return "out of data";
+      const unsigned char* const blockEnd = it + blockSize;
+
+      if (!isCompressed) {
+         if (blockSize > size_t(outEnd - out)) return "output too small";
+         std::memcpy(out, it, blockSize);
+         out += blockSize;
+         it = blockEnd;
+      }
+      else if (twoPhase) {
+         // a few hundred sequences at a time
+         constexpr size_t SequencesPerPass = 256;
+         for (size_t position = 0; position < blockSize;) {
+            const char* error = parseSequences({it, blockSize}, position, uint64_t(out - outBegin),
+                                               uint64_t(outEnd - out), sequences, SequencesPerPass);
+            if (error) return error;
+            out = executeSequences(it, sequences, out);
          }
+         it = blockEnd;
       }
 
-      if (hasBlockChecksum) {
-         it += 4; // ignore checksum, skip 4 bytes
+      while (it != blockEnd && isCompressed && !twoPhase) {
+         const unsigned char token = *it++;
+
+         size_t numLiterals = token >> 4;
+         if (numLiterals == 15) {
+            unsigned char current;
+            do {
+               if (it == blockEnd) return "truncated literal length";
+               current = *it++;
+               numLiterals += current;
+            } while (current == 255);
+         }
+         if (numLiterals > size_t(blockEnd - it)) return "literals beyond end of block";
+         if (numLiterals > size_t(outEnd - out)) return "output too small";
+         std::memcpy(out, it, numLiterals);
+         out += numLiterals;
+         it += numLiterals;
+
+         // last token has only literals
+         if (it == blockEnd) break;
+
+         if (blockEnd - it < 2) return "truncated offset";
+         const size_t delta = it[0] | (size_t(it[1]) << 8);
+         it += 2;
+         if (delta == 0 || delta > size_t(out - outBegin)) return "invalid offset";
+
+         size_t matchLength = 4 + (token & 0x0F);
+         if (matchLength == 4 + 15) {
+            unsigned char current;
+            do {
+               if (it == blockEnd) return "truncated match length";
+               current = *it++;
+               matchLength += current;
+            } while (current == 255);
+         }
+         if (matchLength > size_t(outEnd - out)) return "output too small";
+
+         const unsigned char* from = out - delta;
+         if (delta >= matchLength) {
+            std::memcpy(out, from, matchLength);
+            out += matchLength;
+         }
+         else {
+            // overlapping, slower byte-wise copy
+            while (matchLength-- > 0) *out++ = *from++;
+         }
       }
+
+      if (hasBlockChecksum) it += 4; // ignore checksum
    }
+   if ((flags & 4) != 0 && end - it < 4) return "out of data"; // ignore content checksum
 
-   if (hasContentChecksum) {
-      it += 4; // ignore checksum, skip 4 bytes
+   decompressedSize = size_t(out - outBegin);
+   if ((flags & 8) != 0) {
+      uint64_t contentSize;
+      std::memcpy(&contentSize, frame.data() + 6, 8);
+      if (contentSize != decompressedSize) return "content size mismatch";
    }
+   return nullptr;
+}
 
-   smallz4::dump({history, pos}, b, ix);
+/// decode frames[i] into outputs[i] and store its size or an error in results[i], return number of failed frames
+/** numWorkers = 0 means one per hardware thread, twoPhase enables the two-phase decoder (see parseSequences),
+    frames which weren't decoded before cancellation fail with "cancelled" **/
+size_t unlz4Batch(std::span<const std::span<const unsigned char>> frames,
+                  std::span<const std::span<unsigned char>> outputs, std::span<BatchResult> results,
+                  unsigned numWorkers = 1, bool twoPhase = false, const DecodeHooks& hooks = {})
+{
+   if (outputs.size() != frames.size() || results.size() != frames.size()) unlz4error("batch sizes don't match");
+
+   // first pass: all headers
+   for (size_t i = 0; i < frames.size(); ++i) {
+      results[i] = {0, checkBatchHeader(frames[i], outputs[i].size())};
+   }
+
+   // second pass: decode valid frames, a few dozen per task to keep the scheduling overhead low
+   constexpr size_t FramesPerTask = 64;
+   std::atomic<size_t> numErrors{0};
+   const size_t numTasks = (frames.size() + FramesPerTask - 1) / FramesPerTask;
+   std::vector<std::vector<Sequence>> sequences(parallelWorkers(numTasks, numWorkers));
+   std::mutex progressLock;
+   uint64_t progressDone = 0;
+   parallelFor(numTasks, unsigned(sequences.size()), [&](unsigned worker, size_t task) {
+      const size_t last = (std::min)(frames.size(), (task + 1) * FramesPerTask);
+      size_t taskErrors = 0;
+      for (size_t i = task * FramesPerTask; i < last; ++i) {
+         if (!results[i].error && hooks.isCancelled()) results[i].error = "cancelled";
+         if (!results[i].error) {
+            results[i].error = decodeBatchFrame(frames[i], outputs[i], twoPhase, sequences[worker],
+                                                results[i].decompressedSize);
+         }
+         if (results[i].error) ++taskErrors;
+      }
+      numErrors += taskErrors;
+
+      if (hooks.progress) {
+         std::lock_guard<std::mutex> lock(progressLock);
+         progressDone += last - task * FramesPerTask;
+         hooks.progress(progressDone, frames.size());
+      }
+
+      SMALLZ4_METRICS_ONLY({
+         uint64_t inputBytes = 0;
+         uint64_t outputBytes = 0;
+         for (size_t i = task * FramesPerTask; i < last; ++i) {
+            inputBytes += frames[i].size();
+            outputBytes += results[i].error ? 0 : results[i].decompressedSize;
+         }
+         smallz4_metrics::add(smallz4_metrics::DecodeFrames, last - task * FramesPerTask);
+         smallz4_metrics::add(smallz4_metrics::DecodeInputBytes, inputBytes);
+         smallz4_metrics::add(smallz4_metrics::DecodeOutputBytes, outputBytes);
+         smallz4_metrics::add(smallz4_metrics::DecodeErrors, taskErrors);
+      })
+   });
+   return numErrors;
 }
 
 #include <lz4.h>
 
 #include <chrono>
 #include <iostream>
+#include <memory>
 #include <random>
+#include <unordered_map>
 
 void decompress_lz4(const std::string& compressedText)
 {
@@ -338,7 +1271,403 @@ void sendBytesOriginal(const void* data, size_t numBytes, void*)
    }
 }
 
-int main(int argc, const char* argv[])
+// ==================== FILE MODE ====================
+
+/// load a whole file, return false on failure
+static bool readFile(const char* filename, std::string& content)
+{
+   SMALLZ4_TRACE_SCOPE("read");
+   FILE* in = fopen(filename, "rb");
+   if (!in) return false;
+
+   fseek(in, 0, SEEK_END);
+   const long size = ftell(in);
+   fseek(in, 0, SEEK_SET);
+   if (size < 0) {
+      fclose(in);
+      return false;
+   }
+
+   content.resize(size_t(size));
+   const size_t numRead = fread(content.data(), 1, content.size(), in);
+   fclose(in);
+   return numRead == content.size();
+}
+
+/// write numBytes of data to a new file, return false on failure
+static bool writeFile(const char* filename, const char* data, size_t numBytes)
+{
+   SMALLZ4_TRACE_SCOPE("write");
+   FILE* out = fopen(filename, "wb");
+   if (!out) return false;
+
+   const size_t numWritten = fwrite(data, 1, numBytes, out);
+   return (fclose(out) == 0) && numWritten == numBytes;
+}
+
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+/// a sparse file: mapped read-only, its holes are never read (and thus cost no I/O)
+class SparseFile
+{
+  public:
+   /// map a file if it has holes, return false if it has none (or something failed)
+   bool open(const char* filename)
+   {
+      const int fd = ::open(filename, O_RDONLY);
+      if (fd < 0) return false;
+
+      struct stat info;
+      if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+         close(fd);
+         return false;
+      }
+      const uint64_t size = uint64_t(info.st_size);
+
+      // alternating data and holes, the file system reports holes only at block granularity
+      for (uint64_t pos = 0; pos < size;) {
+         const off_t data = lseek(fd, off_t(pos), SEEK_DATA);
+         if (data < 0) {
+            // trailing hole (or SEEK_DATA isn't supported, then holes is empty anyway)
+            if (errno == ENXIO) holes.push_back({pos, size});
+            break;
+         }
+         if (uint64_t(data) > pos) holes.push_back({pos, uint64_t(data)});
+         const off_t hole = lseek(fd, data, SEEK_HOLE);
+         if (hole < 0) break;
+         pos = uint64_t(hole);
+      }
+
+      void* mapped = holes.empty() ? MAP_FAILED : mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (mapped == MAP_FAILED) {
+         holes.clear();
+         return false;
+      }
+      content = {static_cast<const unsigned char*>(mapped), size};
+      return true;
+   }
+
+   ~SparseFile()
+   {
+      if (!content.empty()) munmap(const_cast<unsigned char*>(content.data()), content.size());
+   }
+
+   /// for smallz4::knownZeros: first hole at or after offset
+   smallz4::ZeroRange nextHole(uint64_t offset) const
+   {
+      auto hole = std::upper_bound(holes.begin(), holes.end(), offset,
+                                   [](uint64_t value, const smallz4::ZeroRange& range) { return value < range.end; });
+      return hole == holes.end() ? smallz4::ZeroRange{0, 0} : *hole;
+   }
+
+   std::span<const unsigned char> content;
+
+  private:
+   std::vector<smallz4::ZeroRange> holes; // sorted
+};
+#endif
+
+/// blocks of a previous output (with a block index) which can be reused by incremental recompression
+class PreviousBlocks
+{
+  public:
+   /// read an existing .lz4 file, return false if it's missing, has no block index or used different settings
+   bool open(const char* filename, uint64_t settingsHash)
+   {
+      if (!readFile(filename, content)) return false;
+      const auto* begin = reinterpret_cast<const unsigned char*>(content.data());
+      std::vector<smallz4::IndexedBlock> blocks;
+      uint64_t settings;
+      if (!smallz4::readBlockIndex(begin, begin + content.size(), blocks, settings)) return false;
+      // e.g. a different compression level => recompress everything
+      if (settings != settingsHash) return false;
+
+      for (const auto& block : blocks) {
+         if (block.compressedOffset + block.compressedSize <= content.size()) byHash.emplace(block.hash, block);
+      }
+      return true;
+   }
+
+   /// for smallz4::previousBlock: compressed block with the same hash and size (or nothing)
+   std::span<const unsigned char> find(uint64_t hash, uint32_t decompressedSize) const
+   {
+      const auto found = byHash.find(hash);
+      if (found == byHash.end() || found->second.decompressedSize != decompressedSize) return {};
+      const auto* begin = reinterpret_cast<const unsigned char*>(content.data());
+      return {begin + found->second.compressedOffset, found->second.compressedSize};
+   }
+
+  private:
+   std::string content;
+   std::unordered_map<uint64_t, smallz4::IndexedBlock> byHash;
+};
+
+/// dictionary used by a compressor (for verification)
+static std::span<const unsigned char> dictionaryOf(const smallz4& context)
+{
+   return context.sharedDictionary ? context.sharedDictionary->content : std::span<const unsigned char>{};
+}
+
+#ifdef SMALLZ4_IO_URING
+/// compress a single file via io_uring / O_DIRECT, written is set as soon as the output file was created,
+/// throws std::runtime_error
+static void compressFileUring(smallz4& context, const char* filename, std::string& compressed,
+                              std::vector<std::string>* verifyFailures, char& written)
+{
+   UringReader reader(filename);
+   UringWriter writer((std::string(filename) + ".lz4").c_str());
+   written = 1;
+
+   // blocks are compressed while the next ones are still being read / the previous ones are still being written
+   context.waitForInput = [&](size_t numBytes) { reader.waitFor(numBytes); };
+   context.flushOutput = [&](std::string& b, size_t& ix) {
+      writer.append(reinterpret_cast<const unsigned char*>(b.data()), ix);
+      ix = 0;
+   };
+
+   const unsigned char* it = reader.data();
+   size_t ix = 0;
+   std::unique_ptr<BlockVerifier> verifier;
+   if (verifyFailures) {
+      const std::span<const unsigned char> source(it, reader.size());
+      verifier = std::make_unique<BlockVerifier>(source, dictionaryOf(context));
+      verifier->watch(context, compressed, ix);
+   }
+   try {
+      context.compress(it, it + reader.size(), compressed, ix);
+   }
+   catch (...) {
+      context.waitForInput = nullptr;
+      context.flushOutput = nullptr;
+      context.chunkDone = nullptr;
+      throw;
+   }
+   context.waitForInput = nullptr;
+   context.flushOutput = nullptr;
+   context.chunkDone = nullptr;
+   if (verifier) *verifyFailures = verifier->finish();
+
+   // end marker
+   writer.append(reinterpret_cast<const unsigned char*>(compressed.data()), ix);
+   writer.finish();
+}
+#endif
+
+/// compress each file to filename + ".lz4", running up to numWorkers files concurrently
+/** - errors are collected per file and reported in command-line order, returns number of failed files
+    - verify: decode each block while the next one is compressed, a file failing verification isn't written
+      (io_uring writes while compressing, its output is deleted afterwards)
+    - incremental: unchanged blocks are copied from an existing .lz4 file (needs settings.storeBlockIndex) **/
+static size_t compressFiles(const std::vector<const char*>& filenames, const smallz4& settings, unsigned numWorkers,
+                            [[maybe_unused]] bool useUring, bool verify, bool incremental)
+{
+   // one compressor per worker (copies of settings), its hash tables are reused for every file of that worker
+   std::vector<smallz4> contexts(parallelWorkers(filenames.size(), numWorkers), settings);
+   // likewise, keep each worker's input and output buffers alive
+   std::vector<std::string> inputs(contexts.size());
+   std::vector<std::string> outputs(contexts.size());
+
+   std::vector<std::string> errors(filenames.size());
+   // one message per block which didn't round-trip
+   std::vector<std::vector<std::string>> verifyFailures(filenames.size());
+   // only output created by this run may be deleted (not std::vector<bool>, workers set their entries concurrently)
+   std::vector<char> written(filenames.size(), 0);
+   parallelFor(filenames.size(), unsigned(contexts.size()), [&](unsigned worker, size_t index) {
+#ifdef SMALLZ4_IO_URING
+      if (useUring) {
+         try {
+            compressFileUring(contexts[worker], filenames[index], outputs[worker],
+                              verify ? &verifyFailures[index] : nullptr, written[index]);
+         }
+         catch (const std::exception& e) {
+            errors[index] = e.what();
+         }
+         return;
+      }
+#endif
+
+      // sparse files (e.g. disk images) are mapped and their holes skipped, other files are read completely
+      std::span<const unsigned char> input;
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+      SparseFile sparse;
+      if (sparse.open(filenames[index])) {
+         input = sparse.content;
+         contexts[worker].knownZeros = [&sparse](uint64_t offset) { return sparse.nextHole(offset); };
+      }
+#endif
+      std::string& text = inputs[worker];
+      if (input.empty()) {
+         if (!readFile(filenames[index], text)) {
+            errors[index] = "cannot read file";
+            return;
+         }
+         input = {reinterpret_cast<const unsigned char*>(text.data()), text.size()};
+      }
+
+      // previous version of the output (it's overwritten afterwards)
+      const std::string filename = std::string(filenames[index]) + ".lz4";
+      PreviousBlocks previous;
+      if (incremental && previous.open(filename.c_str(), contexts[worker].settingsHash())) {
+         contexts[worker].previousBlock = [&previous](uint64_t hash, uint32_t decompressedSize) {
+            return previous.find(hash, decompressedSize);
+         };
+      }
+
+      const unsigned char* it = input.data();
+      const unsigned char* end = it + input.size();
+      std::string& compressed = outputs[worker];
+      size_t ix = 0;
+      // the hooks refer to this file's locals, the context is reused for the worker's next file
+      auto resetHooks = [&context = contexts[worker]] {
+         context.chunkDone = nullptr;
+         context.knownZeros = nullptr;
+         context.previousBlock = nullptr;
+      };
+      std::unique_ptr<BlockVerifier> verifier;
+      try {
+         if (verify) {
+            verifier = std::make_unique<BlockVerifier>(input, dictionaryOf(contexts[worker]));
+            verifier->watch(contexts[worker], compressed, ix);
+         }
+         contexts[worker].compress(it, end, compressed, ix);
+      }
+      catch (const std::exception& e) {
+         resetHooks();
+         errors[index] = e.what();
+         return;
+      }
+      resetHooks();
+      if (verifier) {
+         verifyFailures[index] = verifier->finish();
+         if (!verifyFailures[index].empty()) return;
+      }
+
+      written[index] = 1;
+      if (!writeFile(filename.c_str(), compressed.data(), ix)) {
+         errors[index] = "cannot write file";
+      }
+   });
+
+   // report in input order, no matter which worker finished first
+   size_t numErrors = 0;
+   for (size_t index = 0; index < filenames.size(); ++index) {
+      if (!verifyFailures[index].empty()) {
+         for (const auto& failure : verifyFailures[index]) {
+            fprintf(stderr, "ERROR: %s: verification failed, %s\n", filenames[index], failure.c_str());
+         }
+         if (written[index]) std::remove((std::string(filenames[index]) + ".lz4").c_str());
+         ++numErrors;
+         continue;
+      }
+      if (!errors[index].empty()) {
+         fprintf(stderr, "ERROR: %s: %s\n", filenames[index], errors[index].c_str());
+         ++numErrors;
+      }
+   }
+   return numErrors;
+}
+
+/// validate each .lz4 file and print its decompressed size (see unlz4Scan), returns number of malformed files
+static size_t scanFiles(const std::vector<const char*>& filenames, unsigned numWorkers, uint64_t dictionarySize)
+{
+   std::vector<std::string> inputs(parallelWorkers(filenames.size(), numWorkers));
+   std::vector<ScanResult> results(filenames.size());
+   std::vector<std::string> errors(filenames.size());
+   parallelFor(filenames.size(), unsigned(inputs.size()), [&](unsigned worker, size_t index) {
+      std::string& compressed = inputs[worker];
+      if (!readFile(filenames[index], compressed)) {
+         errors[index] = "cannot read file";
+         return;
+      }
+      const auto* begin = reinterpret_cast<const unsigned char*>(compressed.data());
+      const char* error = unlz4Scan(begin, begin + compressed.size(), results[index], dictionarySize);
+      if (error) errors[index] = error;
+   });
+
+   // report in input order
+   size_t numErrors = 0;
+   for (size_t index = 0; index < filenames.size(); ++index) {
+      if (!errors[index].empty()) {
+         fprintf(stderr, "ERROR: %s: %s\n", filenames[index], errors[index].c_str());
+         ++numErrors;
+         continue;
+      }
+      printf("%s: %llu bytes\n", filenames[index], (unsigned long long)results[index].decompressedSize);
+   }
+   return numErrors;
+}
+
+// ==================== BENCHMARK ====================
+
+/// decode many small frames one by one and as a batch, print records per second
+static void runBatchBenchmark(const std::string& text, uint16_t maxChainLength)
+{
+   // each record is a frame of its own, like cache entries
+   constexpr size_t RecordSize = 4 * 1024;
+   const size_t numRecords = text.size() / RecordSize;
+   std::vector<std::string> frames(numRecords);
+   smallz4 compressor(maxChainLength);
+   for (size_t record = 0; record < numRecords; ++record) {
+      const unsigned char* it = reinterpret_cast<const unsigned char*>(text.data()) + record * RecordSize;
+      size_t ix = 0;
+      compressor.compress(it, it + RecordSize, frames[record], ix);
+      frames[record].resize(ix);
+   }
+
+   std::vector<std::span<const unsigned char>> inputs;
+   std::vector<std::span<unsigned char>> outputs;
+   std::string decompressed(numRecords * RecordSize, '\0');
+   for (size_t record = 0; record < numRecords; ++record) {
+      inputs.push_back({reinterpret_cast<const unsigned char*>(frames[record].data()), frames[record].size()});
+      outputs.push_back({reinterpret_cast<unsigned char*>(decompressed.data()) + record * RecordSize, RecordSize});
+   }
+   std::vector<BatchResult> results(numRecords);
+
+   constexpr int NumRounds = 20;
+   auto report = [&](const char* name, auto&& decode) {
+      auto t0 = std::chrono::steady_clock::now();
+      for (int round = 0; round < NumRounds; ++round) decode();
+      auto t1 = std::chrono::steady_clock::now();
+
+      const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count() * 1e-6;
+      std::cout << name << ": " << (numRecords * NumRounds) / duration << " records/s";
+      const bool isValid = std::all_of(results.begin(), results.end(), [](const BatchResult& result) {
+         return !result.error && result.decompressedSize == RecordSize;
+      });
+      std::cout << (isValid && decompressed == text.substr(0, decompressed.size()) ? "\n" : ", MISMATCH!\n");
+   };
+
+   std::cout << numRecords << " records of " << RecordSize << " bytes\n";
+   std::string single;
+   report("unlz4 per record", [&] {
+      for (size_t record = 0; record < numRecords; ++record) {
+         const unsigned char* it = inputs[record].data();
+         size_t ix = 0;
+         unlz4(it, it + inputs[record].size(), single, ix, nullptr);
+         std::memcpy(outputs[record].data(), single.data(), ix);
+         results[record] = {ix, nullptr};
+      }
+   });
+   std::fill(decompressed.begin(), decompressed.end(), '\0');
+   report("unlz4Batch", [&] { unlz4Batch(inputs, outputs, results, 1); });
+   std::fill(decompressed.begin(), decompressed.end(), '\0');
+   report("unlz4Batch, two-phase", [&] { unlz4Batch(inputs, outputs, results, 1, true); });
+   std::fill(decompressed.begin(), decompressed.end(), '\0');
+   report("unlz4Batch, all threads", [&] { unlz4Batch(inputs, outputs, results, 0); });
+
+   // a truncated frame must fail on its own, with and without two-phase decoding
+   if (numRecords < 2) return;
+   inputs[1] = inputs[1].first(inputs[1].size() / 2);
+   for (bool twoPhase : {false, true}) {
+      const size_t numErrors = unlz4Batch(inputs, outputs, results, 1, twoPhase);
+      const bool isValid = numErrors == 1 && results[1].error && !results[0].error &&
+                           std::memcmp(decompressed.data(), text.data(), RecordSize) == 0;
+      std::cout << (twoPhase ? "two-phase " : "") << "truncated frame " << (isValid ? "detected\n" : "MISSED!\n");
+   }
+}
+
+/// compare against liblz4 and the original implementation
+static int runBenchmark()
 {
    std::string text =
       "LZ4 text compression, an efficient algorithm developed by Yann Collet in 2011, stands out for its remarkable "
@@ -418,10 +1747,451 @@ int main(int argc, const char* argv[])
    if (decompressed == text) {
       std::cout << "decompression succeeded\n";
    }
+
+   // wild-copy-friendly output at a greedy level: must round-trip and each block must end with enough literals
+   // (including a block of known zeros)
+   {
+      smallz4 wild(1);
+      wild.wildCopyDistance = 16;
+      wild.wildCopyTail = 32;
+      const std::string input = text + std::string(65536, '\0');
+      wild.knownZeros = [&text, &input](uint64_t offset) {
+         return offset <= text.size() ? smallz4::ZeroRange{text.size(), input.size()} : smallz4::ZeroRange{0, 0};
+      };
+      std::string frame;
+      size_t frameSize = 0;
+      const unsigned char* from = reinterpret_cast<const unsigned char*>(input.data());
+      wild.compress(from, from + input.size(), frame, frameSize);
+
+      bool isValid = true;
+      const unsigned char* block = reinterpret_cast<const unsigned char*>(frame.data()) + 7; // skip header
+      std::vector<Sequence> sequences;
+      uint64_t history = 0;
+      while (isValid) {
+         uint32_t blockSize;
+         std::memcpy(&blockSize, block, 4);
+         block += 4;
+         const bool isCompressed = (blockSize & 0x80000000) == 0;
+         blockSize &= 0x7FFFFFFF;
+         if (blockSize == 0) break;
+
+         size_t position = 0;
+         if (isCompressed) {
+            isValid = !parseSequences({block, blockSize}, position, history, UINT32_MAX, sequences) &&
+                      !sequences.empty() && sequences.back().matchLength == 0 &&
+                      sequences.back().numLiterals >= wild.wildCopyTail;
+            for (const auto& sequence : sequences) history += sequence.numLiterals + sequence.matchLength;
+         }
+         else {
+            history += blockSize;
+         }
+         block += blockSize;
+      }
+
+      from = reinterpret_cast<const unsigned char*>(frame.data());
+      std::string restored;
+      size_t numBytes = 0;
+      if (isValid) unlz4(from, from + frameSize, restored, numBytes, nullptr);
+      if (isValid && numBytes == input.size() && std::memcmp(restored.data(), input.data(), numBytes) == 0) {
+         std::cout << "wild-copy-friendly output succeeded\n";
+      }
+      else {
+         std::cout << "WILD-COPY-FRIENDLY OUTPUT FAILED!\n";
+      }
+   }
+
+   // in-place: a bounded margin, compressed bytes at the end of the buffer, decompressed bytes at its beginning
+   {
+      smallz4 inPlace(maxChainLength);
+      inPlace.inPlaceBlockMargin = 32;
+      std::string frame;
+      size_t frameSize = 0;
+      const unsigned char* from = reinterpret_cast<const unsigned char*>(text.data());
+      inPlace.compress(from, from + text.size(), frame, frameSize);
+      const auto* frameBytes = reinterpret_cast<const unsigned char*>(frame.data());
+
+      ScanResult scanned;
+      uint64_t decompressedSize = 0;
+      const uint64_t margin = unlz4InPlaceMargin(frameBytes, frameBytes + frameSize, decompressedSize);
+      const bool isBounded = !unlz4Scan(frameBytes, frameBytes + frameSize, scanned) &&
+                             margin <= inPlace.inPlaceBlockMargin + 4 * (scanned.numBlocks + 1);
+
+      std::vector<unsigned char> buffer(decompressedSize + margin);
+      std::memcpy(buffer.data() + buffer.size() - frameSize, frameBytes, frameSize);
+      const size_t numBytes = unlz4InPlace(buffer.data(), buffer.size(), frameSize);
+      if (isBounded && numBytes == text.size() && std::memcmp(buffer.data(), text.data(), numBytes) == 0) {
+         std::cout << "in-place decompression succeeded\n";
+      }
+      else {
+         std::cout << "IN-PLACE DECOMPRESSION FAILED!\n";
+      }
+   }
+
+   // batches of small records: all batches form one frame, each record must be where write() said
+   {
+      std::string frame;
+      std::vector<uint64_t> written, emitted;
+      size_t numRecordBytes = 0;
+      bool rejectsLateWrites = false;
+      {
+         BatchWriter writer(
+            [&](const BatchWriter::Batch& batch) {
+               frame.append(reinterpret_cast<const char*>(batch.compressed.data()), batch.compressed.size());
+               emitted.insert(emitted.end(), batch.recordOffsets.begin(), batch.recordOffsets.end());
+            },
+            64 * 1024, std::chrono::milliseconds(0), maxChainLength);
+         const auto* bytes = reinterpret_cast<const unsigned char*>(text.data());
+         // 1 ... 1000 bytes each, consecutive pieces of the text
+         for (size_t record = 0; numRecordBytes < 1024 * 1024; ++record) {
+            const size_t recordSize = record % 1000 + 1;
+            written.push_back(writer.write({bytes + numRecordBytes, recordSize}));
+            numRecordBytes += recordSize;
+         }
+         // empty records must be listed, too, even if nothing else is pending
+         writer.flush();
+         written.push_back(writer.write({}));
+         writer.close();
+         try {
+            writer.write({bytes, 1});
+         }
+         catch (const std::runtime_error&) {
+            rejectsLateWrites = true;
+         }
+      }
+
+      const unsigned char* from = reinterpret_cast<const unsigned char*>(frame.data());
+      std::string records;
+      size_t numBytes = 0;
+      unlz4(from, from + frame.size(), records, numBytes, nullptr);
+      if (written == emitted && rejectsLateWrites && numBytes == numRecordBytes &&
+          std::memcmp(records.data(), text.data(), numBytes) == 0) {
+         std::cout << "batched records succeeded\n";
+      }
+      else {
+         std::cout << "BATCHED RECORDS FAILED!\n";
+      }
+   }
+
+   // several frames of limited size, each one decoded on its own
+   {
+      smallz4 capped(maxChainLength);
+      capped.maxFrameSize = 256 * 1024;
+      std::vector<smallz4::Frame> frames;
+      capped.frameDone = [&frames](const smallz4::Frame& frame) { frames.push_back(frame); };
+      std::string output;
+      size_t outputSize = 0;
+      const unsigned char* from = reinterpret_cast<const unsigned char*>(text.data());
+      capped.compress(from, from + text.size(), output, outputSize);
+
+      bool isValid = frames.size() > 1;
+      uint64_t compressedOffset = 0;
+      uint64_t decompressedOffset = 0;
+      for (const auto& frame : frames) {
+         isValid &= frame.compressedOffset == compressedOffset && frame.decompressedOffset == decompressedOffset &&
+                    frame.compressedSize <= capped.maxFrameSize;
+         if (!isValid) break;
+
+         const unsigned char* frameIt = reinterpret_cast<const unsigned char*>(output.data()) + frame.compressedOffset;
+         std::string content;
+         size_t numBytes = 0;
+         unlz4(frameIt, frameIt + frame.compressedSize, content, numBytes, nullptr);
+         isValid &= numBytes == frame.decompressedSize &&
+                    std::memcmp(content.data(), text.data() + frame.decompressedOffset, numBytes) == 0;
+         compressedOffset += frame.compressedSize;
+         decompressedOffset += frame.decompressedSize;
+      }
+      if (isValid && compressedOffset == outputSize && decompressedOffset == text.size()) {
+         std::cout << "size-limited frames succeeded\n";
+      }
+      else {
+         std::cout << "SIZE-LIMITED FRAMES FAILED!\n";
+      }
+   }
+
+   // two-phase decoding of each block: sequences first (a few at a time), then copy literals and matches
+   {
+      std::vector<unsigned char> output(text.size());
+      unsigned char* out = output.data();
+      const unsigned char* block = reinterpret_cast<const unsigned char*>(compressed.data()) + 7; // skip header
+      std::vector<Sequence> sequences;
+      const char* error = nullptr;
+      while (!error) {
+         uint32_t blockSize;
+         std::memcpy(&blockSize, block, 4);
+         block += 4;
+         const bool isCompressed = (blockSize & 0x80000000) == 0;
+         blockSize &= 0x7FFFFFFF;
+         if (blockSize == 0) break;
+
+         if (!isCompressed) {
+            std::memcpy(out, block, blockSize);
+            out += blockSize;
+         }
+         for (size_t position = 0; isCompressed && position < blockSize && !error;) {
+            error = parseSequences({block, blockSize}, position, uint64_t(out - output.data()),
+                                   uint64_t(output.data() + output.size() - out), sequences, 100);
+            if (!error) out = executeSequences(block, sequences, out);
+         }
+         block += blockSize;
+      }
+      if (!error && out == output.data() + output.size() && std::memcmp(output.data(), text.data(), text.size()) == 0) {
+         std::cout << "two-phase decoding succeeded\n";
+      }
+      else {
+         std::cout << "TWO-PHASE DECODING FAILED!\n";
+      }
+   }
+
+   // flight recorder: after evicting old segments, a dump holds exactly the most recent bytes
+   {
+      FlightRecorder recorder(256 * 1024, 64 * 1024, maxChainLength);
+      const auto* bytes = reinterpret_cast<const unsigned char*>(text.data());
+      // about 2 MB of 1000 byte records
+      constexpr size_t RecordSize = 1000;
+      constexpr size_t NumLogBytes = 2000 * RecordSize;
+      for (size_t offset = 0; offset < NumLogBytes; offset += RecordSize) {
+         recorder.append({bytes + offset, RecordSize});
+      }
+      std::string dump;
+      size_t dumpSize = 0;
+      recorder.dump(dump, dumpSize);
+      const FlightRecorder::Stats stats = recorder.stats();
+
+      const unsigned char* from = reinterpret_cast<const unsigned char*>(dump.data());
+      std::string retained;
+      size_t numBytes = 0;
+      unlz4(from, from + dumpSize, retained, numBytes, nullptr);
+      if (stats.evictedBytes > 0 && stats.retainedBytes + stats.evictedBytes == NumLogBytes &&
+          numBytes == stats.retainedBytes &&
+          std::memcmp(retained.data(), text.data() + stats.evictedBytes, numBytes) == 0) {
+         std::cout << "flight recorder succeeded\n";
+      }
+      else {
+         std::cout << "FLIGHT RECORDER FAILED!\n";
+      }
+   }
    
    //decompress_lz4(compressed);
 
+   std::cout << '\n';
+   runBatchBenchmark(text, maxChainLength);
    std::cout << '\n';
 
    return 0;
 }
+
+// ==================== COMMAND-LINE HANDLING ====================
+
+/// no filenames: run benchmark, else compress each file (-0 ... -9 = compression level, -j N = number of workers,
+/// -R N = restart point every N blocks, -C N = content-defined chunks of N bytes on average,
+/// -n = blocks end only at newlines, -W = wild-copy-friendly output, -V = verify each block,
+/// -A N = levels 1 - 6 skip positions after 2^N misses in a row (faster, but changes the output),
+/// -I = incremental: reuse unchanged blocks of existing .lz4 files and store a block index (best with -C),
+/// -S = scan: validate .lz4 files and print their decompressed size without decompressing them,
+/// -D dictionary = raw or precomputed dictionary,
+/// -P dictionary = precompute dictionary's tables (writes dictionary.sz4d),
+/// -U = io_uring / O_DIRECT, only if compiled with SMALLZ4_IO_URING,
+/// -T trace.json = timeline, only if compiled with SMALLZ4_TRACE,
+/// -M metrics.txt = counters and histograms in OpenMetrics format, only if compiled with SMALLZ4_METRICS)
+int main(int argc, const char* argv[])
+{
+   uint16_t maxChainLength = 65535; // level 9 => optimal parsing
+   unsigned numWorkers = 0; // one per hardware thread
+   uint32_t restartInterval = 0; // linked blocks only
+   uint32_t chunkAverageSize = 0; // fixed 4 MB blocks
+   bool newlineAligned = false;
+   bool wildCopy = false;
+   uint8_t missAcceleration = 0; // check every position
+   bool verify = false;
+   bool incremental = false;
+   bool scan = false;
+   const char* dictionaryFilename = nullptr;
+   bool useUring = false;
+   [[maybe_unused]] const char* traceFilename = nullptr;
+   [[maybe_unused]] const char* metricsFilename = nullptr;
+   std::vector<const char*> filenames;
+
+   for (int parameter = 1; parameter < argc; parameter++) {
+      const char* current = argv[parameter];
+      if (current[0] == '-' && current[1] >= '0' && current[1] <= '9' && current[2] == '\0') {
+         const int level = current[1] - '0';
+         maxChainLength = (level == 9) ? 65535 : uint16_t(level);
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'j') {
+         const char* number = current[2] ? current + 2 : (parameter + 1 < argc ? argv[++parameter] : "");
+         numWorkers = unsigned(atoi(number));
+         if (numWorkers == 0) unlz4error("invalid number of workers");
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'R') {
+         const char* number = current[2] ? current + 2 : (parameter + 1 < argc ? argv[++parameter] : "");
+         restartInterval = uint32_t(atoi(number));
+         if (restartInterval == 0) unlz4error("invalid restart interval");
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'C') {
+         const char* number = current[2] ? current + 2 : (parameter + 1 < argc ? argv[++parameter] : "");
+         chunkAverageSize = uint32_t(atoi(number));
+         if (chunkAverageSize < 64 || chunkAverageSize > 1024 * 1024 || (chunkAverageSize & (chunkAverageSize - 1)))
+            unlz4error("chunk size must be a power of two between 64 and 1048576");
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'n' && current[2] == '\0') {
+         newlineAligned = true;
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'W' && current[2] == '\0') {
+         wildCopy = true;
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'A') {
+         const char* number = current[2] ? current + 2 : (parameter + 1 < argc ? argv[++parameter] : "");
+         const int acceleration = atoi(number);
+         if (acceleration < 1 || acceleration > 16) unlz4error("miss acceleration must be between 1 and 16");
+         missAcceleration = uint8_t(acceleration);
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'V' && current[2] == '\0') {
+         verify = true;
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'I' && current[2] == '\0') {
+         incremental = true;
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'S' && current[2] == '\0') {
+         scan = true;
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'D' && current[2] == '\0') {
+         if (parameter + 1 >= argc) unlz4error("no dictionary filename found");
+         dictionaryFilename = argv[++parameter];
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'P' && current[2] == '\0') {
+         if (parameter + 1 >= argc) unlz4error("no dictionary filename found");
+         std::string dictionary;
+         if (!readFile(argv[++parameter], dictionary)) unlz4error("cannot read dictionary");
+         try {
+            SharedDictionary::save((std::string(argv[parameter]) + ".sz4d").c_str(),
+                                   {reinterpret_cast<const unsigned char*>(dictionary.data()), dictionary.size()});
+         }
+         catch (const std::exception& e) {
+            unlz4error(e.what());
+         }
+         return 0;
+      }
+
+      if (current[0] == '-' && current[1] == 'U' && current[2] == '\0') {
+#ifndef SMALLZ4_IO_URING
+         unlz4error("compiled without io_uring support (SMALLZ4_IO_URING)");
+#endif
+         useUring = true;
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'T' && current[2] == '\0') {
+#ifndef SMALLZ4_TRACE
+         unlz4error("compiled without tracing support (SMALLZ4_TRACE)");
+#endif
+         if (parameter + 1 >= argc) unlz4error("no trace filename found");
+         traceFilename = argv[++parameter];
+         continue;
+      }
+
+      if (current[0] == '-' && current[1] == 'M' && current[2] == '\0') {
+#ifndef SMALLZ4_METRICS
+         unlz4error("compiled without metrics support (SMALLZ4_METRICS)");
+#endif
+         if (parameter + 1 >= argc) unlz4error("no metrics filename found");
+         metricsFilename = argv[++parameter];
+         continue;
+      }
+
+      if (current[0] == '-') unlz4error("unknown option");
+
+      filenames.push_back(current);
+   }
+
+   SMALLZ4_TRACE_ONLY(if (traceFilename) smallz4_trace::enable();)
+
+   // a block which refers to a dictionary can't be moved, and io_uring output overwrites the previous version early
+   if (incremental && dictionaryFilename) unlz4error("incremental mode can't be combined with a dictionary");
+   if (incremental && useUring) unlz4error("incremental mode can't be combined with io_uring");
+
+   smallz4 settings(maxChainLength);
+   settings.restartInterval = restartInterval;
+   settings.storeBlockIndex = incremental;
+   if (newlineAligned) settings.recordDelimiter = '\n';
+   settings.missAcceleration = missAcceleration;
+   if (wildCopy) {
+      settings.wildCopyDistance = 16;
+      settings.wildCopyTail = 32;
+   }
+
+   // dictionary: map precomputed tables or hash it once for all files
+   std::unique_ptr<SharedDictionary> precomputed;
+   std::string dictionary;
+   std::vector<uint32_t> dictionaryLastHash;
+   std::vector<uint16_t> dictionaryPreviousHash, dictionaryPreviousExact;
+   smallz4::DictionaryTables dictionaryTables{};
+   if (dictionaryFilename && SharedDictionary::isSharedDictionary(dictionaryFilename)) {
+      try {
+         precomputed = std::make_unique<SharedDictionary>(dictionaryFilename);
+      }
+      catch (const std::exception& e) {
+         unlz4error(e.what());
+      }
+      settings.sharedDictionary = &precomputed->tables();
+   }
+   else if (dictionaryFilename) {
+      if (!readFile(dictionaryFilename, dictionary)) unlz4error("cannot read dictionary");
+      // only the last 64k are relevant
+      const size_t relevant = (std::min)(dictionary.size(), size_t(65535));
+      const unsigned char* dictionaryEnd = reinterpret_cast<const unsigned char*>(dictionary.data()) + dictionary.size();
+      dictionaryTables.content = {dictionaryEnd - relevant, relevant};
+      dictionaryLastHash.resize(smallz4::DictionaryHashSize);
+      dictionaryPreviousHash.resize(smallz4::DictionaryChainSize);
+      dictionaryPreviousExact.resize(smallz4::DictionaryChainSize);
+      smallz4::buildDictionaryTables(dictionaryTables.content, dictionaryLastHash.data(), dictionaryPreviousHash.data(),
+                                     dictionaryPreviousExact.data());
+      dictionaryTables.lastHash = dictionaryLastHash.data();
+      dictionaryTables.previousHash = dictionaryPreviousHash.data();
+      dictionaryTables.previousExact = dictionaryPreviousExact.data();
+      settings.sharedDictionary = &dictionaryTables;
+   }
+   if (chunkAverageSize > 0) {
+      // FastCDC's defaults: a quarter to eight times the average
+      settings.chunkAverageSize = chunkAverageSize;
+      settings.chunkMinSize = chunkAverageSize / 4;
+      settings.chunkMaxSize = (std::min)(chunkAverageSize * 8, uint32_t(4 * 1024 * 1024));
+   }
+
+   const uint64_t dictionarySize = settings.sharedDictionary ? settings.sharedDictionary->content.size() : 0;
+   int result;
+   if (scan) {
+      result = scanFiles(filenames, numWorkers, dictionarySize) == 0 ? 0 : 1;
+   }
+   else {
+      result = filenames.empty()
+                  ? runBenchmark()
+                  : (compressFiles(filenames, settings, numWorkers, useUring, verify, incremental) == 0 ? 0 : 1);
+   }
+
+   SMALLZ4_TRACE_ONLY(if (traceFilename && !smallz4_trace::save(traceFilename)) unlz4error("cannot write trace file");)
+   SMALLZ4_METRICS_ONLY(
+      if (metricsFilename && !smallz4_metrics::save(metricsFilename)) unlz4error("cannot write metrics file");)
+   return result;
+}
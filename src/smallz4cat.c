@@ -23,7 +23,7 @@
 
 // This program is a shorter, more readable, albeit slower re-implementation of lz4cat ( https://github.com/Cyan4973/xxHash )
 
-// compile: gcc smallz4cat.c -O3 -o smallz4cat -Wall -pedantic -std=c99 -s
+// compile: gcc smallz4cat.c -O3 -o smallz4cat -Wall -pedantic -std=c99 -s -pthread
 // The static 8k binary was compiled using Clang and dietlibc (see https://www.fefe.de/dietlibc/ )
 
 // Limitations:
@@ -32,22 +32,113 @@
 
 // Replace getByteFromIn() and sendToOut() by your own code if you need in-memory LZ4 decompression.
 // Corrupted data causes a call to unlz4error().
+// unlz4_progress() reports progress and can be cancelled by its callback.
+
+// Several files can be decompressed at once: "smallz4cat -j 8 a.lz4 b.lz4 c.lz4" creates a, b and c.
+// Define SMALLZ4CAT_NO_THREADS if your platform lacks POSIX threads, then all files are processed one after another.
+
+// Linux only: compile with -DSMALLZ4_IO_URING and run with -U to read/write files via io_uring and O_DIRECT
+// (several 4 MB reads and writes stay in flight while decoding, the page cache isn't touched).
+
+// Frames compressed with restart points ("smallz4 -R N") end with a restart index: if STDOUT is a regular file
+// then their independent groups of blocks are decoded in parallel (-j limits the number of threads).
 
 // suppress warnings when compiled by Visual C++
 #define _CRT_SECURE_NO_WARNINGS
+#if defined(__linux__) && defined(SMALLZ4_IO_URING)
+// O_DIRECT and syscall() are GNU extensions
+#define _GNU_SOURCE
+#else
+#undef SMALLZ4_IO_URING
+// sysconf() is POSIX, not C99
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#if defined(_WIN32) && !defined(SMALLZ4CAT_NO_THREADS)
+#define SMALLZ4CAT_NO_THREADS
+#endif
 
+#include <setjmp.h> // longjmp (abort a single file in multi-file mode)
 #include <stdio.h>  // stdin/stdout/stderr, fopen, ...
 #include <stdlib.h> // exit()
 #include <string.h> // memcpy
 
+#ifndef SMALLZ4CAT_NO_THREADS
+#include <fcntl.h>    // fcntl (O_APPEND)
+#include <pthread.h>
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // sysconf, pwrite
+#endif
+
+// long runs of zeros become holes when writing to a regular file (sparse output)
+#if defined(__unix__) || defined(__APPLE__)
+#define SMALLZ4CAT_SPARSE
+#include <fcntl.h>    // fcntl (O_APPEND)
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // ftruncate, lseek
+#endif
+
+// optional USDT static tracepoints for bpftrace & co., see include/smallz4_probes.hpp (compile with -DSMALLZ4_USDT)
+//   decode__block__start(block index, stored size, compressed ? 1 : 0)
+//   decode__block__end  (block index, stored size, compressed ? 1 : 0)
+#if defined(SMALLZ4_USDT) && defined(__linux__)
+#include <sys/sdt.h>
+#define SMALLZ4_PROBE3(name, a, b, c) DTRACE_PROBE3(smallz4, name, a, b, c)
+#else
+#define SMALLZ4_PROBE3(name, a, b, c)
+#endif
+
+#ifdef SMALLZ4_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #ifndef FALSE
 #define FALSE 0
 #define TRUE  1
 #endif
 
+/// where unlz4error() jumps to in multi-file mode instead of terminating the program
+struct ErrorTarget
+{
+  jmp_buf     jump;
+  const char* msg;
+};
+
+#ifndef SMALLZ4CAT_NO_THREADS
+/// each worker thread has its own ErrorTarget (key is created only in multi-file mode)
+static pthread_key_t errorTargetKey;
+static int           hasErrorTargetKey = FALSE;
+static struct ErrorTarget* getErrorTarget(void)                      { return hasErrorTargetKey ? (struct ErrorTarget*)pthread_getspecific(errorTargetKey) : NULL; }
+static void                setErrorTarget(struct ErrorTarget* target) { pthread_setspecific(errorTargetKey, target); }
+static void enableErrorTargets(void)
+{
+  if (hasErrorTargetKey)
+    return;
+  pthread_key_create(&errorTargetKey, NULL);
+  hasErrorTargetKey = TRUE;
+}
+#else
+static struct ErrorTarget* errorTarget = NULL;
+static struct ErrorTarget* getErrorTarget(void)                      { return errorTarget; }
+static void                setErrorTarget(struct ErrorTarget* target) { errorTarget = target; }
+#endif
+
 /// error handler
 static void unlz4error(const char* msg)
 {
+  // multi-file mode: give up on the current file only
+  struct ErrorTarget* target = getErrorTarget();
+  if (target != NULL)
+  {
+    target->msg = msg;
+    longjmp(target->jump, 1);
+  }
+
   // smaller static binary than fprintf(stderr, "ERROR: %s\n", msg);
   fputs("ERROR: ", stderr);
   fputs(msg,       stderr);
@@ -63,6 +154,8 @@ static void unlz4error(const char* msg)
 typedef unsigned char (*GET_BYTE)  (void* userPtr);
 // write several bytes,      see sendBytesToOut() for a basic implementation
 typedef void          (*SEND_BYTES)(const unsigned char*, unsigned int, void* userPtr);
+// optional: number of bytes decoded so far, return non-zero to cancel decoding (see unlz4_progress)
+typedef int           (*PROGRESS)  (unsigned long long numDecoded, void* userPtr);
 
 struct UserPtr
 {
@@ -74,6 +167,16 @@ struct UserPtr
   unsigned char readBuffer[READ_BUFFER_SIZE];
   unsigned int  pos;
   unsigned int  available;
+#ifdef SMALLZ4_IO_URING
+  // if not NULL then use getByteFromRing() and sendBytesToRing() instead
+  struct UringIO* ring;
+#endif
+#ifdef SMALLZ4CAT_SPARSE
+  // if TRUE then chunks of zeros are skipped instead of written (see enableSparseOutput())
+  int sparse;
+  // last chunk was skipped, file must be extended at the end (see finishSparseOutput())
+  int endsWithHole;
+#endif
 };
 
 /// read a single byte (with simple buffering)
@@ -95,21 +198,432 @@ static unsigned char getByteFromIn(void* userPtr) // parameter "userPtr" not nee
   return user->readBuffer[user->pos++];
 }
 
+#ifdef SMALLZ4CAT_SPARSE
+// smaller runs of zeros aren't worth a hole
+#define MIN_HOLE_SIZE 4096
+
+/// true if all bytes are zero
+static int isZero(const unsigned char* data, unsigned int numBytes)
+{
+  return numBytes > 0 && data[0] == 0 && memcmp(data, data + 1, numBytes - 1) == 0;
+}
+
+/// skipped zeros read back as zeros only if nothing is stored at or behind the current position of a regular file
+static int canSkipZeros(int fd)
+{
+  struct stat info;
+  return fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && !(fcntl(fd, F_GETFL) & O_APPEND) &&
+         info.st_size <= lseek(fd, 0, SEEK_CUR);
+}
+
+/// decide whether user->out may become a sparse file
+static void enableSparseOutput(struct UserPtr* user)
+{
+  fflush(user->out);
+  user->sparse       = canSkipZeros(fileno(user->out));
+  user->endsWithHole = FALSE;
+}
+
+/// a hole at the end must be turned into file size, return FALSE on failure
+static int finishSparseOutput(struct UserPtr* user)
+{
+  if (!user->sparse || !user->endsWithHole)
+    return TRUE;
+  user->endsWithHole = FALSE;
+  return fflush(user->out) == 0 && ftruncate(fileno(user->out), ftell(user->out)) == 0;
+}
+#endif
+
 /// write a block of bytes
 static void sendBytesToOut(const unsigned char* data, unsigned int numBytes, void* userPtr)
 {
   /// cast user-specific data
   struct UserPtr* user = (struct UserPtr*)userPtr;
-  if (data != NULL && numBytes > 0)
-    fwrite(data, 1, numBytes, user->out);
+  if (data == NULL || numBytes == 0)
+    return;
+
+#ifdef SMALLZ4CAT_SPARSE
+  // seeking beyond the end of a file leaves a hole
+  if (user->sparse && numBytes >= MIN_HOLE_SIZE && isZero(data, numBytes))
+  {
+    if (fseek(user->out, numBytes, SEEK_CUR) != 0)
+      unlz4error("cannot write output file");
+    user->endsWithHole = TRUE;
+    return;
+  }
+  user->endsWithHole = FALSE;
+#endif
+
+  fwrite(data, 1, numBytes, user->out);
+}
+
+
+#ifdef SMALLZ4_IO_URING
+// ==================== IO_URING BACKEND ====================
+
+
+// each read/write covers 4 MB (the LZ4 block size), several of them are in flight
+#define URING_CHUNK_SIZE  4*1024*1024
+#define URING_DEPTH       4
+// O_DIRECT needs aligned buffers, offsets and sizes
+#define URING_ALIGNMENT   4096
+
+/// raw io_uring (no liburing needed)
+struct Uring
+{
+  int                  fd;
+  void*                sqRing;
+  void*                cqRing;
+  size_t               sqSize;
+  size_t               cqSize;
+  struct io_uring_sqe* sqes;
+  size_t               sqesSize;
+  unsigned*            sqTail;
+  unsigned*            sqArray;
+  unsigned             sqMask;
+  unsigned*            cqHead;
+  unsigned*            cqTail;
+  unsigned             cqMask;
+  struct io_uring_cqe* cqes;
+  unsigned             toSubmit;
+  unsigned             inFlight;
+};
+
+/// per-worker state: one ring, URING_DEPTH input and URING_DEPTH output buffers
+struct UringIO
+{
+  struct Uring   uring;
+  // input
+  int            inFd;
+  unsigned char* inBuffers[URING_DEPTH];
+  int            inResult [URING_DEPTH]; // bytes read, -1 if still in flight
+  unsigned int   inChunk;                // currently consumed chunk, stored in inBuffers[inChunk % URING_DEPTH]
+  unsigned int   inNext;                 // next chunk to be read
+  // output
+  int            outFd;
+  int            outDirect;
+  unsigned char* outBuffers[URING_DEPTH];
+  unsigned int   outBusy   [URING_DEPTH]; // size of a pending write, 0 if idle
+  unsigned int   outCurrent;
+  unsigned int   outFill;
+  long long      outOffset;
+};
+
+/// set up io_uring, return FALSE if not available
+static int uringInit(struct Uring* ring, unsigned entries)
+{
+  struct io_uring_params params;
+  int singleMap;
+  memset(&params, 0, sizeof(params));
+  memset(ring,    0, sizeof(*ring));
+
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0)
+    return FALSE;
+
+  ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqSize = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+  singleMap    = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (singleMap)
+  {
+    if (ring->cqSize > ring->sqSize)
+      ring->sqSize = ring->cqSize;
+    ring->cqSize = ring->sqSize;
+  }
+
+  ring->sqRing   = mmap(NULL, ring->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cqRing   = singleMap ? ring->sqRing :
+                   mmap(NULL, ring->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes     = (struct io_uring_sqe*)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+  {
+    close(ring->fd);
+    return FALSE;
+  }
+
+  ring->sqTail  = (unsigned*)((unsigned char*)ring->sqRing + params.sq_off.tail);
+  ring->sqMask  = *(unsigned*)((unsigned char*)ring->sqRing + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned*)((unsigned char*)ring->sqRing + params.sq_off.array);
+  ring->cqHead  = (unsigned*)((unsigned char*)ring->cqRing + params.cq_off.head);
+  ring->cqTail  = (unsigned*)((unsigned char*)ring->cqRing + params.cq_off.tail);
+  ring->cqMask  = *(unsigned*)((unsigned char*)ring->cqRing + params.cq_off.ring_mask);
+  ring->cqes    = (struct io_uring_cqe*)((unsigned char*)ring->cqRing + params.cq_off.cqes);
+  return TRUE;
+}
+
+/// release io_uring
+static void uringExit(struct Uring* ring)
+{
+  munmap(ring->sqes, ring->sqesSize);
+  if (ring->cqRing != ring->sqRing)
+    munmap(ring->cqRing, ring->cqSize);
+  munmap(ring->sqRing, ring->sqSize);
+  close(ring->fd);
+}
+
+/// queue a read or write, it will be submitted by uringWait()
+static void uringPrepare(struct Uring* ring, unsigned char opcode, int fd, void* buffer, unsigned int numBytes, long long offset, unsigned long long userData)
+{
+  unsigned tail  = *ring->sqTail;
+  unsigned index = tail & ring->sqMask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode    = opcode;
+  sqe->fd        = fd;
+  sqe->addr      = (unsigned long long)(size_t)buffer;
+  sqe->len       = numBytes;
+  sqe->off       = (unsigned long long)offset;
+  sqe->user_data = userData;
+  ring->sqArray[index] = index;
+  __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  ring->toSubmit++;
+  ring->inFlight++;
+}
+
+/// submit all queued requests and wait for one to finish, result is number of bytes or -errno
+static unsigned long long uringWait(struct Uring* ring, int* result)
+{
+  while (1)
+  {
+    unsigned head = *ring->cqHead;
+    if (ring->toSubmit == 0 && head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    {
+      struct io_uring_cqe* cqe = &ring->cqes[head & ring->cqMask];
+      unsigned long long userData = cqe->user_data;
+      *result = cqe->res;
+      __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+      ring->inFlight--;
+      return userData;
+    }
+
+    long submitted = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (submitted < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      unlz4error("io_uring_enter failed");
+    }
+    ring->toSubmit -= (unsigned)submitted;
+  }
+}
+
+/// process one completion (user data: 0 ... URING_DEPTH-1 are reads, URING_DEPTH ... 2*URING_DEPTH-1 are writes)
+/** returns FALSE if the request failed **/
+static int uringReap(struct UringIO* io)
+{
+  int result;
+  unsigned long long id = uringWait(&io->uring, &result);
+  if (id < URING_DEPTH)
+  {
+    io->inResult[id] = result < 0 ? 0 : result;
+    return result >= 0;
+  }
+
+  id -= URING_DEPTH;
+  result = (result == (int)io->outBusy[id]);
+  io->outBusy[id] = 0;
+  return result;
+}
+
+/// allocate ring and buffers, return NULL if io_uring isn't available
+static struct UringIO* uringCreate(void)
+{
+  int i;
+  struct UringIO* io = (struct UringIO*)calloc(1, sizeof(struct UringIO));
+  if (!io)
+    return NULL;
+  if (!uringInit(&io->uring, 2 * URING_DEPTH))
+  {
+    free(io);
+    return NULL;
+  }
+  for (i = 0; i < URING_DEPTH; i++)
+    if (posix_memalign((void**)&io->inBuffers [i], URING_ALIGNMENT, URING_CHUNK_SIZE) != 0 ||
+        posix_memalign((void**)&io->outBuffers[i], URING_ALIGNMENT, URING_CHUNK_SIZE) != 0)
+      unlz4error("out of memory");
+  io->inFd  = -1;
+  io->outFd = -1;
+  return io;
+}
+
+/// free everything
+static void uringDestroy(struct UringIO* io)
+{
+  int i;
+  for (i = 0; i < URING_DEPTH; i++)
+  {
+    free(io->inBuffers [i]);
+    free(io->outBuffers[i]);
+  }
+  uringExit(&io->uring);
+  free(io);
+}
+
+/// open with O_DIRECT, fall back to buffered I/O if the filesystem refuses (e.g. tmpfs)
+static int openDirect(const char* filename, int flags, int* isDirect)
+{
+  int fd = open(filename, flags | O_DIRECT, 0644);
+  *isDirect = (fd >= 0);
+  if (fd < 0 && errno == EINVAL)
+    fd = open(filename, flags, 0644);
+  return fd;
+}
+
+/// start reading a file, return FALSE if it can't be opened
+static int uringOpenInput(struct UringIO* io, const char* filename)
+{
+  int isDirect, i;
+  io->inFd = openDirect(filename, O_RDONLY, &isDirect);
+  if (io->inFd < 0)
+    return FALSE;
+
+  // keep URING_DEPTH reads in flight
+  for (i = 0; i < URING_DEPTH; i++)
+  {
+    io->inResult[i] = -1;
+    uringPrepare(&io->uring, IORING_OP_READ, io->inFd, io->inBuffers[i], URING_CHUNK_SIZE, (long long)i * URING_CHUNK_SIZE, i);
+  }
+  io->inChunk = 0;
+  io->inNext  = URING_DEPTH;
+  return TRUE;
+}
+
+/// create output file, return FALSE on failure
+static int uringOpenOutput(struct UringIO* io, const char* filename)
+{
+  io->outFd      = openDirect(filename, O_WRONLY | O_CREAT | O_TRUNC, &io->outDirect);
+  io->outCurrent = 0;
+  io->outFill    = 0;
+  io->outOffset  = 0;
+  return io->outFd >= 0;
+}
+
+/// read a single byte from the current chunk, switch to the next chunk when exhausted
+static unsigned char getByteFromRing(void* userPtr)
+{
+  struct UserPtr* user = (struct UserPtr*)userPtr;
+  struct UringIO* io   = user->ring;
+
+  if (user->pos == user->available)
+  {
+    unsigned int slot = io->inChunk % URING_DEPTH;
+    // not the very first chunk ? => recycle its buffer for a read further ahead
+    if (user->available > 0)
+    {
+      io->inResult[slot] = -1;
+      uringPrepare(&io->uring, IORING_OP_READ, io->inFd, io->inBuffers[slot], URING_CHUNK_SIZE, (long long)io->inNext * URING_CHUNK_SIZE, slot);
+      io->inNext++;
+      io->inChunk++;
+      slot = io->inChunk % URING_DEPTH;
+    }
+
+    while (io->inResult[slot] < 0)
+      if (!uringReap(io))
+        unlz4error("I/O error");
+
+    user->pos       = 0;
+    user->available = (unsigned int)io->inResult[slot];
+    if (user->available == 0)
+      unlz4error("out of data");
+  }
+
+  return io->inBuffers[io->inChunk % URING_DEPTH][user->pos++];
 }
 
+/// submit the current output buffer
+static void uringFlushOutput(struct UringIO* io, unsigned int numBytes)
+{
+  uringPrepare(&io->uring, IORING_OP_WRITE, io->outFd, io->outBuffers[io->outCurrent], numBytes, io->outOffset, URING_DEPTH + io->outCurrent);
+  io->outBusy[io->outCurrent] = numBytes;
+  io->outOffset += io->outFill;
+  io->outFill    = 0;
+  io->outCurrent = (io->outCurrent + 1) % URING_DEPTH;
+
+  // next buffer still in flight ?
+  while (io->outBusy[io->outCurrent] > 0)
+    if (!uringReap(io))
+      unlz4error("I/O error");
+}
+
+/// copy to the current output buffer, full buffers are written asynchronously
+static void sendBytesToRing(const unsigned char* data, unsigned int numBytes, void* userPtr)
+{
+  struct UserPtr* user = (struct UserPtr*)userPtr;
+  struct UringIO* io   = user->ring;
+
+  while (numBytes > 0)
+  {
+    unsigned int now = URING_CHUNK_SIZE - io->outFill;
+    if (now > numBytes)
+      now = numBytes;
+    memcpy(io->outBuffers[io->outCurrent] + io->outFill, data, now);
+    io->outFill += now;
+    data        += now;
+    numBytes    -= now;
+
+    if (io->outFill == URING_CHUNK_SIZE)
+      uringFlushOutput(io, URING_CHUNK_SIZE);
+  }
+}
+
+/// write the last output buffer and wait until everything is written
+static void uringFinish(struct UringIO* io)
+{
+  if (io->outFd < 0)
+    return;
+
+  long long total = io->outOffset + io->outFill;
+  if (io->outFill > 0)
+  {
+    // O_DIRECT writes whole sectors, the file is truncated afterwards
+    unsigned int padded = io->outDirect ? (io->outFill + URING_ALIGNMENT - 1) / URING_ALIGNMENT * URING_ALIGNMENT : io->outFill;
+    memset(io->outBuffers[io->outCurrent] + io->outFill, 0, padded - io->outFill);
+    uringFlushOutput(io, padded);
+  }
+
+  // wait for all pending requests
+  while (io->uring.inFlight > 0)
+    if (!uringReap(io))
+      unlz4error("I/O error");
+  if (io->outDirect && ftruncate(io->outFd, total) != 0)
+    unlz4error("cannot write output file");
+}
+
+/// drain the ring (e.g. after an error) and close both files, the ring can be reused for the next file afterwards
+static int uringClose(struct UringIO* io)
+{
+  int ok = TRUE;
+  while (io->uring.inFlight > 0)
+    uringReap(io);
+  memset(io->outBusy, 0, sizeof(io->outBusy));
+
+  if (io->inFd >= 0)
+    close(io->inFd);
+  if (io->outFd >= 0 && close(io->outFd) != 0)
+    ok = FALSE;
+  io->inFd  = -1;
+  io->outFd = -1;
+  return ok;
+}
+
+#endif
+
 
 // ==================== LZ4 DECOMPRESSOR ====================
 
 
-/// decompress everything in input stream (accessed via getByte) and write to output stream (via sendBytes)
-void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionary, void* userPtr)
+/// properties of an LZ4 frame, see unlz4_header()
+struct FrameInfo
+{
+  unsigned char isLegacy;
+  unsigned char hasBlockChecksum;
+  unsigned char hasContentChecksum;
+};
+
+/// parse frame header
+static void unlz4_header(GET_BYTE getByte, struct FrameInfo* frame, void* userPtr)
 {
   // signature
   unsigned char signature1 = getByte(userPtr);
@@ -121,6 +635,7 @@ void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionar
   unsigned char isLegacy   = (signature == 0x184C2102);
   if (!isModern && !isLegacy)
     unlz4error("invalid signature");
+  frame->isLegacy = isLegacy;
 
   unsigned char hasBlockChecksum   = FALSE;
   unsigned char hasContentSize     = FALSE;
@@ -158,12 +673,33 @@ void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionar
       getByte(userPtr);
   }
 
+  frame->hasBlockChecksum   = hasBlockChecksum;
+  frame->hasContentChecksum = hasContentChecksum;
+}
+
+/// decode blocks until the end marker is found or maxBytes compressed bytes were consumed (0 => no limit),
+/// history starts empty
+/** blockIndex of the first block is only needed for probes
+    progress (may be NULL) is called before each block and after each 64k of output, return FALSE if it cancelled **/
+static int unlz4_blocks(GET_BYTE getByte, SEND_BYTES sendBytes, PROGRESS progress, const struct FrameInfo* frame,
+                        const char* dictionary, unsigned int blockIndex, unsigned long long maxBytes, void* userPtr)
+{
+  unsigned char isLegacy         = frame->isLegacy;
+  unsigned char isModern         = !isLegacy;
+  unsigned char hasBlockChecksum = frame->hasBlockChecksum;
+  // block headers, blocks and block checksums read so far
+  unsigned long long numConsumed = 0;
+
   // don't lower this value, backreferences can be 64kb far away
 #define HISTORY_SIZE 64*1024
   // contains the latest decoded data
   unsigned char history[HISTORY_SIZE];
   // next free position in history[]
   unsigned int  pos = 0;
+  // bytes already sent (only needed for progress reports)
+  unsigned long long numSent = 0;
+  // cancelled by progress() ?
+  int cancelled = FALSE;
 
   // dictionary compression is a recently introduced feature, just move its contents to the buffer
   if (dictionary != NULL)
@@ -187,8 +723,11 @@ void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionar
   }
 
   // parse all blocks until blockSize == 0
-  while (1)
+  for (; maxBytes == 0 || numConsumed < maxBytes; blockIndex++)
   {
+    if (progress != NULL && progress(numSent + pos, userPtr))
+      return FALSE;
+
     // block size
     unsigned int blockSize = getByte(userPtr);
     blockSize |= (unsigned int)getByte(userPtr) <<  8;
@@ -204,6 +743,10 @@ void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionar
     if (blockSize == 0)
       break;
 
+    unsigned int storedSize = blockSize;
+    numConsumed += 4 + (unsigned long long)blockSize + (hasBlockChecksum ? 4 : 0);
+    SMALLZ4_PROBE3(decode__block__start, blockIndex, storedSize, isCompressed);
+
     if (isCompressed)
     {
       // decompress block
@@ -211,6 +754,10 @@ void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionar
       unsigned int numWritten  = 0;
       while (blockOffset < blockSize)
       {
+        // sub-block cancellation (after a flush of history[])
+        if (cancelled)
+          return FALSE;
+
         // get a token
         unsigned char token = getByte(userPtr);
         blockOffset++;
@@ -249,6 +796,8 @@ void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionar
             if (pos == HISTORY_SIZE)
             {
               sendBytes(history, HISTORY_SIZE, userPtr);
+              numSent += HISTORY_SIZE;
+              cancelled = cancelled || (progress != NULL && progress(numSent, userPtr));
               numWritten += HISTORY_SIZE;
               pos = 0;
             }
@@ -282,8 +831,32 @@ void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionar
 
         // copy match
         unsigned int referencePos = (pos >= delta) ? (pos - delta) : (HISTORY_SIZE + pos - delta);
+        if (delta == 1)
+        {
+          // run of a single byte (e.g. zeros of a sparse file): fill history in large chunks
+          unsigned char value = history[referencePos];
+          while (matchLength > 0)
+          {
+            unsigned int chunk = HISTORY_SIZE - pos;
+            if (chunk > matchLength)
+              chunk = matchLength;
+            memset(history + pos, value, chunk);
+            pos         += chunk;
+            matchLength -= chunk;
+
+            if (pos == HISTORY_SIZE)
+            {
+              // flush output buffer
+              sendBytes(history, HISTORY_SIZE, userPtr);
+              numSent += HISTORY_SIZE;
+              cancelled = cancelled || (progress != NULL && progress(numSent, userPtr));
+              numWritten += HISTORY_SIZE;
+              pos = 0;
+            }
+          }
+        }
         // start and end within the current 64k block ?
-        if (pos + matchLength < HISTORY_SIZE && referencePos + matchLength < HISTORY_SIZE)
+        else if (pos + matchLength < HISTORY_SIZE && referencePos + matchLength < HISTORY_SIZE)
         {
           // read/write continuous block (no wrap-around at the end of history[])
           // fast copy
@@ -313,6 +886,8 @@ void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionar
             {
               // flush output buffer
               sendBytes(history, HISTORY_SIZE, userPtr);
+              numSent += HISTORY_SIZE;
+              cancelled = cancelled || (progress != NULL && progress(numSent, userPtr));
               numWritten += HISTORY_SIZE;
               pos = 0;
             }
@@ -329,7 +904,7 @@ void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionar
     else
     {
       // copy uncompressed data and add to history, too (if next block is compressed and some matches refer to this block)
-      while (blockSize-- > 0)
+      while (blockSize-- > 0 && !cancelled)
       {
         // copy a byte ...
         history[pos++] = getByte(userPtr);
@@ -337,11 +912,19 @@ void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionar
         if (pos == HISTORY_SIZE)
         {
           sendBytes(history, HISTORY_SIZE, userPtr);
+          numSent += HISTORY_SIZE;
+          cancelled = cancelled || (progress != NULL && progress(numSent, userPtr));
           pos = 0;
         }
       }
     }
 
+    if (cancelled)
+      return FALSE;
+
+    SMALLZ4_PROBE3(decode__block__end, blockIndex, storedSize, isCompressed);
+    (void)storedSize; (void)blockIndex;
+
     if (hasBlockChecksum)
     {
       // ignore checksum, skip 4 bytes
@@ -349,14 +932,33 @@ void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionar
     }
   }
 
-  if (hasContentChecksum)
+  // flush output buffer
+  sendBytes(history, pos, userPtr);
+  return TRUE;
+}
+
+/// like unlz4_userPtr, but report progress (may be NULL) and stop early if it returns non-zero
+/** progress is called before each block and after each 64k of output, so decoding stops within milliseconds;
+    returns FALSE if cancelled (then the output is incomplete) **/
+int unlz4_progress(GET_BYTE getByte, SEND_BYTES sendBytes, PROGRESS progress, const char* dictionary, void* userPtr)
+{
+  struct FrameInfo frame;
+  unlz4_header(getByte, &frame, userPtr);
+  if (!unlz4_blocks(getByte, sendBytes, progress, &frame, dictionary, 0, 0, userPtr))
+    return FALSE;
+
+  if (frame.hasContentChecksum)
   {
     // ignore checksum, skip 4 bytes
     getByte(userPtr); getByte(userPtr); getByte(userPtr); getByte(userPtr);
   }
+  return TRUE;
+}
 
-  // flush output buffer
-  sendBytes(history, pos, userPtr);
+/// decompress everything in input stream (accessed via getByte) and write to output stream (via sendBytes)
+void unlz4_userPtr(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionary, void* userPtr)
+{
+  unlz4_progress(getByte, sendBytes, NULL, dictionary, userPtr);
 }
 
 /// old interface where getByte and sendBytes use global file handles
@@ -366,6 +968,475 @@ void unlz4(GET_BYTE getByte, SEND_BYTES sendBytes, const char* dictionary)
 }
 
 
+#ifndef SMALLZ4CAT_NO_THREADS
+// ==================== RESTART GROUPS ====================
+
+
+// a restart index (see smallz4::readRestartIndex in smallz4.hpp) follows frames compressed with a restart interval:
+// each group of blocks between two restart points doesn't refer to earlier groups and can be decoded on its own
+#define RESTART_INDEX_MAGIC  0x184D2A5E
+#define RESTART_INDEX_FOOTER 0x52345A53
+
+/// restart points of a frame
+struct RestartIndex
+{
+  unsigned int        numPoints;
+  unsigned long long  decompressedSize;
+  unsigned long long* compressedOffsets;   // relative to the beginning of the frame
+  unsigned long long* decompressedOffsets;
+};
+
+/// read an unsigned little-endian integer
+static unsigned long long readLittleEndian(const unsigned char* data, int numBytes)
+{
+  unsigned long long result = 0;
+  while (numBytes-- > 0)
+    result = (result << 8) | data[numBytes];
+  return result;
+}
+
+/// look for a restart index at the end of a file, return FALSE if there is none
+static int readRestartIndex(FILE* in, struct RestartIndex* index)
+{
+  unsigned char trailer[16];
+  unsigned char header [8];
+  unsigned char entry  [16];
+  unsigned long payloadSize;
+  unsigned int  i;
+
+  if (fseek(in, -16, SEEK_END) != 0 || fread(trailer, 1, 16, in) != 16)
+    return FALSE;
+  if (readLittleEndian(trailer + 12, 4) != RESTART_INDEX_FOOTER)
+    return FALSE;
+  index->decompressedSize = readLittleEndian(trailer,     8);
+  index->numPoints        = (unsigned int)readLittleEndian(trailer + 8, 4);
+
+  // skippable frame's header
+  payloadSize = index->numPoints * 16UL + 16;
+  if (fseek(in, -(long)(payloadSize + 8), SEEK_END) != 0 || fread(header, 1, 8, in) != 8)
+    return FALSE;
+  if (readLittleEndian(header, 4) != RESTART_INDEX_MAGIC || readLittleEndian(header + 4, 4) != payloadSize)
+    return FALSE;
+
+  index->compressedOffsets   = (unsigned long long*)malloc(index->numPoints * sizeof(unsigned long long));
+  index->decompressedOffsets = (unsigned long long*)malloc(index->numPoints * sizeof(unsigned long long));
+  for (i = 0; i < index->numPoints; i++)
+  {
+    if (fread(entry, 1, 16, in) != 16)
+      unlz4error("invalid restart index");
+    index->compressedOffsets  [i] = readLittleEndian(entry,     8);
+    index->decompressedOffsets[i] = readLittleEndian(entry + 8, 8);
+  }
+  return TRUE;
+}
+
+/// shared state of all group decoders
+struct GroupJobs
+{
+  const char*             filename;
+  int                     outFd;
+  long long               outBase;  // file position of the first decompressed byte
+  const struct FrameInfo* frame;
+  const char*             dictionary;
+  struct RestartIndex*    index;
+  unsigned int            next;     // next group to be processed
+  const char*             error;    // first error
+  int                     sparse;   // skip chunks of zeros (holes)
+  pthread_mutex_t         lock;
+};
+
+/// each group writes straight to its final position in the output file
+struct GroupUser
+{
+  struct UserPtr          user;     // must be the first member (getByteFromIn() casts to UserPtr)
+  int                     outFd;
+  long long               outOffset;
+};
+
+/// write a block of bytes at the group's current output position
+static void sendBytesAt(const unsigned char* data, unsigned int numBytes, void* userPtr)
+{
+  struct GroupUser* group = (struct GroupUser*)userPtr;
+#ifdef SMALLZ4CAT_SPARSE
+  // leave a hole
+  if (group->user.sparse && numBytes >= MIN_HOLE_SIZE && isZero(data, numBytes))
+  {
+    group->outOffset += numBytes;
+    return;
+  }
+#endif
+  while (numBytes > 0)
+  {
+    ssize_t written = pwrite(group->outFd, data, numBytes, group->outOffset);
+    if (written <= 0)
+      unlz4error("cannot write output file");
+    data              += written;
+    numBytes          -= (unsigned int)written;
+    group->outOffset  += written;
+  }
+}
+
+/// decode the next restart group, returns FALSE if none are left (errors longjmp to the worker)
+static int decodeNextGroup(struct GroupJobs* jobs, struct GroupUser* group)
+{
+  struct RestartIndex* index = jobs->index;
+  unsigned int current;
+  unsigned long long groupEnd;
+  unsigned long long groupBytes;
+
+  pthread_mutex_lock(&jobs->lock);
+  current = jobs->next < index->numPoints && jobs->error == NULL ? jobs->next++ : index->numPoints;
+  pthread_mutex_unlock(&jobs->lock);
+  if (current == index->numPoints)
+    return FALSE;
+
+  groupEnd = current + 1 < index->numPoints ? index->decompressedOffsets[current + 1] : index->decompressedSize;
+
+  // jump to the group's first block
+  if (fseek(group->user.in, (long)index->compressedOffsets[current], SEEK_SET) != 0)
+    unlz4error("invalid restart index");
+  group->user.pos       = 0;
+  group->user.available = 0;
+  group->outOffset      = jobs->outBase + (long long)index->decompressedOffsets[current];
+
+  // blocks may be shorter than 4 MB (zeros, records, frame limits): a group ends where the next one begins
+  groupBytes = current + 1 < index->numPoints ? index->compressedOffsets[current + 1] - index->compressedOffsets[current]
+                                              : 0;
+  unlz4_blocks(getByteFromIn, sendBytesAt, NULL, jobs->frame, current == 0 ? jobs->dictionary : NULL, 0, groupBytes,
+               group);
+  if (group->outOffset != jobs->outBase + (long long)groupEnd)
+    unlz4error("restart index doesn't match frame");
+  return TRUE;
+}
+
+/// worker thread: decode groups until none are left
+/** the per-group state lives in decodeNextGroup(), so no local variable changes between setjmp and longjmp **/
+static void* decodeGroupWorker(void* param)
+{
+  struct GroupJobs*    jobs  = (struct GroupJobs*)param;
+  struct GroupUser*    group = (struct GroupUser*)malloc(sizeof(struct GroupUser));
+  struct ErrorTarget   target;
+
+  group->user.in = fopen(jobs->filename, "rb");
+  group->outFd   = jobs->outFd;
+#ifdef SMALLZ4_IO_URING
+  group->user.ring = NULL;
+#endif
+#ifdef SMALLZ4CAT_SPARSE
+  group->user.sparse = jobs->sparse;
+#endif
+  setErrorTarget(&target);
+  if (group->user.in != NULL)
+  {
+    if (setjmp(target.jump) == 0)
+    {
+      while (decodeNextGroup(jobs, group))
+        ;
+    }
+    else
+    {
+      pthread_mutex_lock(&jobs->lock);
+      if (jobs->error == NULL)
+        jobs->error = target.msg;
+      pthread_mutex_unlock(&jobs->lock);
+    }
+  }
+  setErrorTarget(NULL);
+
+  if (group->user.in != NULL)
+    fclose(group->user.in);
+  else
+  {
+    pthread_mutex_lock(&jobs->lock);
+    jobs->error = "file not found";
+    pthread_mutex_unlock(&jobs->lock);
+  }
+  free(group);
+  return NULL;
+}
+
+/// decode restart groups in parallel if the frame has a restart index and STDOUT is a regular file
+/** returns FALSE if not applicable (then nothing was written and user->in must be rewound) **/
+static int decompressRestartGroups(const char* filename, struct UserPtr* user, int numWorkers, const char* dictionary)
+{
+  struct RestartIndex index;
+  struct FrameInfo    frame;
+  struct GroupJobs    jobs;
+  struct stat         info;
+  pthread_t*          threads;
+  int i;
+
+  // output must allow random access
+  int outFd = fileno(stdout);
+  if (fstat(outFd, &info) != 0 || !S_ISREG(info.st_mode) || (fcntl(outFd, F_GETFL) & O_APPEND))
+    return FALSE;
+  if (numWorkers <= 0)
+    numWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (numWorkers <= 1 || !readRestartIndex(user->in, &index))
+    return FALSE;
+  if (index.numPoints < 2)
+  {
+    free(index.compressedOffsets);
+    free(index.decompressedOffsets);
+    return FALSE;
+  }
+  if ((unsigned int)numWorkers > index.numPoints)
+    numWorkers = (int)index.numPoints;
+
+  // parse frame header
+  rewind(user->in);
+  user->pos       = 0;
+  user->available = 0;
+  unlz4_header(getByteFromIn, &frame, user);
+  if (frame.isLegacy)
+    unlz4error("restart index requires a modern frame");
+
+  fflush(stdout);
+  jobs.filename   = filename;
+  jobs.outFd      = outFd;
+  jobs.outBase    = (long long)lseek(outFd, 0, SEEK_CUR);
+  jobs.frame      = &frame;
+  jobs.dictionary = dictionary;
+  jobs.index      = &index;
+  jobs.next       = 0;
+  jobs.error      = NULL;
+#ifdef SMALLZ4CAT_SPARSE
+  jobs.sparse     = canSkipZeros(outFd);
+#else
+  jobs.sparse     = FALSE;
+#endif
+  pthread_mutex_init(&jobs.lock, NULL);
+  enableErrorTargets();
+
+  // the main thread is a worker, too
+  threads = (pthread_t*)malloc(numWorkers * sizeof(pthread_t));
+  for (i = 1; i < numWorkers; i++)
+    if (pthread_create(&threads[i], NULL, decodeGroupWorker, &jobs) != 0)
+      unlz4error("cannot create thread");
+  decodeGroupWorker(&jobs);
+  for (i = 1; i < numWorkers; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  pthread_mutex_destroy(&jobs.lock);
+
+  if (jobs.error != NULL)
+    unlz4error(jobs.error);
+  // trailing holes weren't written at all
+  if (jobs.sparse && fstat(outFd, &info) == 0 && info.st_size < jobs.outBase + (long long)index.decompressedSize &&
+      ftruncate(outFd, jobs.outBase + (long long)index.decompressedSize) != 0)
+    unlz4error("cannot write output file");
+
+  // continue after the decompressed data
+  lseek(outFd, jobs.outBase + (long long)index.decompressedSize, SEEK_SET);
+  free(index.compressedOffsets);
+  free(index.decompressedOffsets);
+  return TRUE;
+}
+#endif
+
+
+// ==================== MULTI-FILE MODE ====================
+
+
+/// shared state of all workers
+struct FileJobs
+{
+  const char** filenames;
+  const char** errors;     // one per file, NULL if successful
+  int          numFiles;
+  int          next;       // next file to be processed
+  const char*  dictionary;
+  int          useRing;    // io_uring / O_DIRECT
+#ifndef SMALLZ4CAT_NO_THREADS
+  pthread_mutex_t lock;
+#endif
+};
+
+/// fetch index of next unprocessed file, -1 if all done
+static int nextFileJob(struct FileJobs* jobs)
+{
+  int index;
+#ifndef SMALLZ4CAT_NO_THREADS
+  pthread_mutex_lock(&jobs->lock);
+#endif
+  index = jobs->next < jobs->numFiles ? jobs->next++ : -1;
+#ifndef SMALLZ4CAT_NO_THREADS
+  pthread_mutex_unlock(&jobs->lock);
+#endif
+  return index;
+}
+
+/// decompress "name.lz4" to "name"
+static void decompressFileJob(struct FileJobs* jobs, int index, struct UserPtr* user, struct ErrorTarget* target)
+{
+  const char* filename = jobs->filenames[index];
+  size_t      length   = strlen(filename);
+  char*       outname;
+
+  if (length <= 4 || strcmp(filename + length - 4, ".lz4") != 0)
+  {
+    jobs->errors[index] = "filename must end with .lz4";
+    return;
+  }
+
+  // reset input buffer, it's reused for every file of this worker
+  user->pos       = 0;
+  user->available = 0;
+
+#ifdef SMALLZ4_IO_URING
+  if (user->ring != NULL)
+  {
+    int ok;
+    outname = (char*)malloc(length - 4 + 1);
+    memcpy(outname, filename, length - 4);
+    outname[length - 4] = '\0';
+    ok = uringOpenInput(user->ring, filename);
+    if (!ok)
+      jobs->errors[index] = "file not found";
+    else if (!uringOpenOutput(user->ring, outname))
+      jobs->errors[index] = "cannot create output file";
+    free(outname);
+
+    if (ok && jobs->errors[index] == NULL)
+    {
+      // errors of this file end up here
+      if (setjmp(target->jump) == 0)
+      {
+        unlz4_userPtr(getByteFromRing, sendBytesToRing, jobs->dictionary, user);
+        uringFinish(user->ring);
+      }
+      else
+        jobs->errors[index] = target->msg;
+    }
+
+    if (!uringClose(user->ring) && jobs->errors[index] == NULL)
+      jobs->errors[index] = "cannot write output file";
+    return;
+  }
+#endif
+
+  user->in        = fopen(filename, "rb");
+  if (!user->in)
+  {
+    jobs->errors[index] = "file not found";
+    return;
+  }
+
+  outname = (char*)malloc(length - 4 + 1);
+  memcpy(outname, filename, length - 4);
+  outname[length - 4] = '\0';
+  user->out = fopen(outname, "wb");
+  free(outname);
+  if (!user->out)
+  {
+    fclose(user->in);
+    jobs->errors[index] = "cannot create output file";
+    return;
+  }
+
+  // errors of this file end up here
+  if (setjmp(target->jump) == 0)
+  {
+#ifdef SMALLZ4CAT_SPARSE
+    enableSparseOutput(user);
+    unlz4_userPtr(getByteFromIn, sendBytesToOut, jobs->dictionary, user);
+    if (!finishSparseOutput(user))
+      jobs->errors[index] = "cannot write output file";
+#else
+    unlz4_userPtr(getByteFromIn, sendBytesToOut, jobs->dictionary, user);
+#endif
+  }
+  else
+    jobs->errors[index] = target->msg;
+
+  fclose(user->in);
+  if (fclose(user->out) != 0 && jobs->errors[index] == NULL)
+    jobs->errors[index] = "cannot write output file";
+}
+
+/// worker thread: process files until none are left
+static void* decompressFileWorker(void* param)
+{
+  struct FileJobs*  jobs = (struct FileJobs*)param;
+  // per-worker context, reused for all files
+  struct UserPtr*   user = (struct UserPtr*)malloc(sizeof(struct UserPtr));
+  struct ErrorTarget target;
+  int index;
+
+#ifdef SMALLZ4_IO_URING
+  user->ring = jobs->useRing ? uringCreate() : NULL;
+#endif
+
+  setErrorTarget(&target);
+  while ((index = nextFileJob(jobs)) >= 0)
+    decompressFileJob(jobs, index, user, &target);
+  setErrorTarget(NULL);
+
+#ifdef SMALLZ4_IO_URING
+  if (user->ring != NULL)
+    uringDestroy(user->ring);
+#endif
+  free(user);
+  return NULL;
+}
+
+/// decompress all files, at most numWorkers at the same time, return number of failed files
+static int decompressFiles(const char** filenames, int numFiles, int numWorkers, const char* dictionary, int useRing)
+{
+  struct FileJobs jobs;
+  int numErrors = 0;
+  int i;
+
+  jobs.filenames  = filenames;
+  jobs.errors     = (const char**)calloc(numFiles, sizeof(const char*));
+  jobs.numFiles   = numFiles;
+  jobs.next       = 0;
+  jobs.dictionary = dictionary;
+  jobs.useRing    = useRing;
+
+#ifndef SMALLZ4CAT_NO_THREADS
+  {
+    pthread_t* threads;
+    if (numWorkers <= 0)
+      numWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (numWorkers > numFiles)
+      numWorkers = numFiles;
+    if (numWorkers < 1)
+      numWorkers = 1;
+
+    pthread_mutex_init(&jobs.lock, NULL);
+    enableErrorTargets();
+
+    // the main thread is a worker, too
+    threads = (pthread_t*)malloc(numWorkers * sizeof(pthread_t));
+    for (i = 1; i < numWorkers; i++)
+      if (pthread_create(&threads[i], NULL, decompressFileWorker, &jobs) != 0)
+        unlz4error("cannot create thread");
+    decompressFileWorker(&jobs);
+    for (i = 1; i < numWorkers; i++)
+      pthread_join(threads[i], NULL);
+
+    free(threads);
+    pthread_mutex_destroy(&jobs.lock);
+  }
+#else
+  (void)numWorkers;
+  decompressFileWorker(&jobs);
+#endif
+
+  // report errors in command-line order
+  for (i = 0; i < numFiles; i++)
+    if (jobs.errors[i] != NULL)
+    {
+      fprintf(stderr, "ERROR: %s: %s\n", filenames[i], jobs.errors[i]);
+      numErrors++;
+    }
+
+  free(jobs.errors);
+  return numErrors;
+}
+
+
 // ==================== COMMAND-LINE HANDLING ====================
 
 
@@ -382,6 +1453,13 @@ int main(int argc, const char* argv[])
   };
 
   const char* dictionary = NULL;
+  // 0 => one worker per CPU core
+  int numWorkers = 0;
+  // io_uring / O_DIRECT
+  int useRing = FALSE;
+  // all filenames
+  const char** filenames = (const char**)malloc(argc * sizeof(const char*));
+  int numFiles = 0;
 
   // first command-line parameter is our input filename / but ignore "-" which stands for STDIN
   int parameter;
@@ -397,21 +1475,98 @@ int main(int argc, const char* argv[])
       continue;
     }
 
+    // number of workers in multi-file mode
+    if (current[0] == '-' && current[1] == 'j')
+    {
+      if (current[2] == '\0' && parameter + 1 >= argc)
+        unlz4error("no number of workers found");
+      numWorkers = atoi(current[2] != '\0' ? current + 2 : argv[++parameter]);
+      if (numWorkers <= 0)
+        unlz4error("invalid number of workers");
+      continue;
+    }
+
+    // io_uring
+    if (current[0] == '-' && current[1] == 'U')
+    {
+#ifdef SMALLZ4_IO_URING
+      struct UringIO* probe = uringCreate();
+      if (probe == NULL)
+        unlz4error("io_uring not available");
+      uringDestroy(probe);
+      useRing = TRUE;
+#else
+      unlz4error("compiled without io_uring support (SMALLZ4_IO_URING)");
+#endif
+      continue;
+    }
+
     // filename
     // read from STDIN, default behavior
     if (current[0] != '-' && current[1] != '\0')
+      filenames[numFiles++] = current;
+  }
+
+  // several files: decompress each "name.lz4" to "name"
+  if (numFiles > 1)
+  {
+    int numErrors = decompressFiles(filenames, numFiles, numWorkers, dictionary, useRing);
+    free(filenames);
+    return numErrors == 0 ? 0 : 1;
+  }
+
+  // a single file is written to STDOUT
+#ifdef SMALLZ4_IO_URING
+  if (numFiles == 1 && useRing)
+  {
+    // read via io_uring, STDOUT stays buffered
+    user.ring = uringCreate();
+    if (!uringOpenInput(user.ring, filenames[0]))
+      unlz4error("file not found");
+    free(filenames);
+
+#ifdef SMALLZ4CAT_SPARSE
+    enableSparseOutput(&user);
+#endif
+    unlz4_userPtr(getByteFromRing, sendBytesToOut, dictionary, &user);
+#ifdef SMALLZ4CAT_SPARSE
+    if (!finishSparseOutput(&user))
+      unlz4error("cannot write output file");
+#endif
+    uringClose(user.ring);
+    uringDestroy(user.ring);
+    return 0;
+  }
+#endif
+  if (numFiles == 1)
+  {
+    // get handle
+    user.in = fopen(filenames[0], "rb");
+    if (!user.in)
+      unlz4error("file not found");
+
+#ifndef SMALLZ4CAT_NO_THREADS
+    // independent groups of blocks ? => decode them in parallel
+    if (decompressRestartGroups(filenames[0], &user, numWorkers, dictionary))
     {
-      // already have a filename - at most one filename is allowed (except for dictionary) ?
-      if (user.in != stdin)
-        unlz4error("can only decompress one file at a time");
-      // get handle
-      user.in = fopen(argv[1], "rb");
-      if (!user.in)
-        unlz4error("file not found");
+      free(filenames);
+      return 0;
     }
+    rewind(user.in);
+    user.pos       = 0;
+    user.available = 0;
+#endif
   }
+  free(filenames);
 
   // and go !
+#ifdef SMALLZ4CAT_SPARSE
+  enableSparseOutput(&user);
+#endif
   unlz4_userPtr(getByteFromIn, sendBytesToOut, dictionary, &user);
+#ifdef SMALLZ4CAT_SPARSE
+  if (!finishSparseOutput(&user))
+    unlz4error("cannot write output file");
+#endif
   return 0;
 }